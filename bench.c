@@ -0,0 +1,1085 @@
+/*
+ * bench.c Throughput benchmarks for wave_gen and the step sources
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "count_backend.h"
+#include "linear_source.h"
+#include "pi_backend.h"
+#include "pi_hw/pi_gpio.h"
+#include "pi_hw/pi_util.h"
+#include "pipe_backend.h"
+#include "step_gen.h"
+#include "step_source.h"
+#include "scurve_gen.h"
+#include "tee_backend.h"
+#include "types.h"
+#include "vcd_backend.h"
+#include "wave_gen.h"
+
+#define BENCH_BUDGET 1600
+/* pi_backend runs against pi_sim's DMA, in real time, so keep this short */
+#define PI_BENCH_CHUNKS 100
+
+/*
+ * Allocation counting. The bench is linked with --wrap for each of these,
+ * so every call from wave_gen and the sources ends up here.
+ */
+static unsigned long n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	n_allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	n_allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	n_allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct square_wave_source {
+	struct source base;
+	int period;
+	int pin;
+	bool rising;
+};
+
+static int square_wave_source_delay(struct source *s)
+{
+	struct square_wave_source *ss = (struct square_wave_source *)s;
+
+	return ss->period / 2;
+}
+
+static void square_wave_source_event(struct source *s, struct event *ev)
+{
+	struct square_wave_source *ss = (struct square_wave_source *)s;
+
+	ev->channel = ss->pin;
+	ev->type = ss->rising ? EVENT_RISING_EDGE : EVENT_FALLING_EDGE;
+	ss->rising = !ss->rising;
+}
+
+static int square_wave_source_fill(struct source *s, struct timed_event *buf,
+				   int max, int horizon)
+{
+	struct square_wave_source *ss = (struct square_wave_source *)s;
+	int delay = ss->period / 2;
+	int n = 0, t = 0;
+
+	do {
+		buf[n].ev.channel = ss->pin;
+		buf[n].ev.type = ss->rising ? EVENT_RISING_EDGE : EVENT_FALLING_EDGE;
+		buf[n].delay = delay;
+		ss->rising = !ss->rising;
+
+		t += delay;
+		n++;
+	} while (n < max && t < horizon);
+
+	return n;
+}
+
+struct mix {
+	int n_square;
+	int n_step;
+	int chunks;
+	bool fill;
+	bool runs;
+	bool dual_edge;
+	enum step_profile profile;
+};
+
+/*
+ * Keep each stepper shuttling back and forth. Pins wrap at 32, so the speeds
+ * wrap at 50 instead, to keep every stepper's pin and speed different (up
+ * to 800 of them), the same as the square waves' pins and periods
+ */
+static void refill_moves(struct step_source **steps, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct step_source *ss = steps[i];
+
+		while (ss->n_moves < 2) {
+			int32_t target = ss->queued_pos > 0 ? -20000 : 20000;
+			step_source_queue_move(&ss->base, target, 40 + (i % 50) * 1.4, 200);
+		}
+	}
+}
+
+static int bench_mix(const struct mix *mix)
+{
+	struct square_wave_source *squares;
+	struct step_source **steps;
+	struct count_backend *cb;
+	struct wave_ctx ctx = { 0 };
+	unsigned long allocs;
+	uint64_t split, run_steps, events;
+	int per_step;
+	uint64_t start, elapsed = 0;
+	int i, ret = -1;
+
+	cb = count_backend_create();
+	squares = calloc(mix->n_square, sizeof(*squares));
+	steps = calloc(mix->n_step, sizeof(*steps));
+	if (!cb || (mix->n_square && !squares) || (mix->n_step && !steps)) {
+		goto fail;
+	}
+	ctx.be = &cb->base;
+
+	for (i = 0; i < mix->n_square; i++) {
+		struct square_wave_source *sq = &squares[i];
+
+		sq->base.get_delay = square_wave_source_delay;
+		sq->base.gen_event = square_wave_source_event;
+		if (mix->fill) {
+			sq->base.fill = square_wave_source_fill;
+		}
+		sq->pin = i % 32;
+		sq->period = 20 + 2 * (i % 50);
+
+		if (wave_ctx_add_source(&ctx, &sq->base)) {
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < mix->n_step; i++) {
+		steps[i] = step_source_create(i % 32);
+		if (!steps[i]) {
+			goto fail;
+		}
+
+		step_source_set_profile(&steps[i]->base, mix->profile);
+		step_source_set_dual_edge(&steps[i]->base, mix->dual_edge);
+		step_source_set_fill(&steps[i]->base, mix->fill);
+		if (!mix->runs) {
+			steps[i]->base.get_run = NULL;
+		}
+
+		if (wave_ctx_add_source(&ctx, &steps[i]->base)) {
+			goto fail;
+		}
+	}
+
+	/* Warm up, so the moves' ramp tables are allocated */
+	refill_moves(steps, mix->n_step);
+	wave_gen(&ctx, BENCH_BUDGET);
+	count_backend_reset(cb);
+	split = ctx.run_steps_split;
+
+	allocs = n_allocs;
+	for (i = 0; i < mix->chunks; i++) {
+		refill_moves(steps, mix->n_step);
+
+		start = now_ns();
+		wave_gen(&ctx, BENCH_BUDGET);
+		elapsed += now_ns() - start;
+	}
+	allocs = n_allocs - allocs;
+	run_steps = cb->run_steps + ctx.run_steps_split - split;
+	per_step = mix->dual_edge ? 1 : 2;
+	/*
+	 * Events, counting the steps add_run took as the events they'd have
+	 * been. Sources sharing a pin can have edges in the same slot, which
+	 * count_backend only counts once, so the shares of events from runs
+	 * and via add_run, and ns/event, don't use edges.
+	 */
+	events = cb->events + (cb->run_steps * per_step);
+	printf("%4d sq %4d step  %-4s %-4s %-4s  %9.2f Medges/s %7.1f ns/edge %7.1f ns/event  "
+	       "%5.1f%% runs (%5.1f%% add_run)  %lu allocs\n",
+	       mix->n_square, mix->n_step,
+	       mix->fill ? "fill" : "",
+	       mix->runs ? "runs" : "",
+	       mix->dual_edge ? "dual" : "",
+	       (cb->edges * 1000.0) / elapsed,
+	       (double)elapsed / cb->edges,
+	       (double)elapsed / events,
+	       (100.0 * run_steps * per_step) / events,
+	       (100.0 * cb->run_steps * per_step) / events,
+	       allocs);
+
+	if (mix->runs && mix->n_step && !run_steps) {
+		fprintf(stderr, "Step runs are enabled, but none were used\n");
+		goto fail;
+	}
+
+	ret = 0;
+
+fail:
+	wave_ctx_fini(&ctx);
+	for (i = 0; steps && i < mix->n_step; i++) {
+		if (steps[i]) {
+			step_source_destroy(steps[i]);
+		}
+	}
+	free(steps);
+	free(squares);
+	if (cb) {
+		count_backend_destroy(cb);
+	}
+
+	return ret;
+}
+
+static int bench_sources(int chunks)
+{
+	static const int counts[] = { 4, 32, 256 };
+	struct mix mix = {
+		.chunks = chunks,
+		.profile = STEP_PROFILE_TABLE,
+	};
+	unsigned int i;
+	int ret = 0;
+
+	printf("== wave_gen throughput (%d x %d-tick chunks) ==\n", chunks, BENCH_BUDGET);
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		int n = counts[i];
+
+		mix = (struct mix){ .n_square = n, .chunks = chunks };
+		ret |= bench_mix(&mix);
+		mix.fill = true;
+		ret |= bench_mix(&mix);
+
+		mix = (struct mix){ .n_step = n, .chunks = chunks,
+				    .profile = STEP_PROFILE_TABLE };
+		ret |= bench_mix(&mix);
+		mix.fill = true;
+		ret |= bench_mix(&mix);
+		mix.runs = true;
+		ret |= bench_mix(&mix);
+		mix.dual_edge = true;
+		ret |= bench_mix(&mix);
+
+		mix = (struct mix){ .n_square = n / 2, .n_step = n / 2, .chunks = chunks,
+				    .fill = true, .runs = true,
+				    .profile = STEP_PROFILE_TABLE };
+		ret |= bench_mix(&mix);
+	}
+
+	return ret;
+}
+
+static const double profile_speeds[] = { 100, 20, 150, 0 };
+#define N_PROFILE_SPEEDS (sizeof(profile_speeds) / sizeof(profile_speeds[0]))
+
+/*
+ * Run one profile engine over full accel/decel ramps between each of
+ * profile_speeds, optionally recording every interval. Returns the time
+ * taken in ns.
+ */
+static uint64_t run_profile(enum step_profile p, int steps, uint32_t *intervals)
+{
+	struct step_ctx sctx = { 0 };
+	struct step_ctx_fixed fctx = { 0 };
+	struct step_ctx_table tctx = { 0 };
+	struct scurve_ctx scctx = { 0 };
+	volatile uint32_t sink;
+	uint64_t start, elapsed = 0;
+	unsigned int s;
+	uint32_t c = 0;
+	int i;
+
+	step_ctx_init(&sctx, 600, 100000, 100);
+	step_ctx_fixed_init(&fctx, 600, 100000, 100);
+	step_ctx_table_init(&tctx, 600, 100000, 100);
+	scurve_ctx_init(&scctx, 600, 100000, 100, 1000);
+
+	for (s = 0; s < N_PROFILE_SPEEDS; s++) {
+		stepper_set_speed(&sctx, profile_speeds[s]);
+		stepper_fixed_set_speed(&fctx, profile_speeds[s]);
+		stepper_table_set_speed(&tctx, profile_speeds[s]);
+		scurve_set_speed(&scctx, profile_speeds[s]);
+
+		start = now_ns();
+		for (i = 0; i < steps; i++) {
+			switch (p) {
+			case STEP_PROFILE_DOUBLE:
+				stepper_tick(&sctx);
+				c = round(sctx.c);
+				break;
+			case STEP_PROFILE_FIXED:
+				stepper_fixed_tick(&fctx);
+				c = stepper_fixed_interval(&fctx);
+				break;
+			case STEP_PROFILE_TABLE:
+				stepper_table_tick(&tctx);
+				c = tctx.c >> STEP_FIXED_SHIFT;
+				break;
+			case STEP_PROFILE_SCURVE:
+				scurve_tick(&scctx);
+				c = lround(scctx.c);
+				break;
+			}
+
+			if (intervals) {
+				intervals[(s * steps) + i] = c;
+			} else {
+				sink = c;
+			}
+		}
+		elapsed += now_ns() - start;
+	}
+	(void)sink;
+
+	step_ctx_table_fini(&tctx);
+
+	return elapsed;
+}
+
+/*
+ * Per-tick cost of each profile engine, and the biggest difference from
+ * the double-precision engine's rounded intervals
+ */
+static int bench_profiles(int steps)
+{
+	static const char *names[] = {
+		[STEP_PROFILE_DOUBLE] = "double",
+		[STEP_PROFILE_FIXED] = "fixed",
+		[STEP_PROFILE_TABLE] = "table",
+		[STEP_PROFILE_SCURVE] = "scurve",
+	};
+	int n = steps * N_PROFILE_SPEEDS;
+	uint32_t *ref, *intervals;
+	enum step_profile p;
+	uint64_t elapsed;
+	long err, max_err;
+	int i;
+
+	ref = calloc(n, sizeof(*ref));
+	intervals = calloc(n, sizeof(*intervals));
+	if (!ref || !intervals) {
+		free(ref);
+		free(intervals);
+		return -1;
+	}
+
+	printf("== Step profile engines (%d ticks per speed change) ==\n", steps);
+
+	run_profile(STEP_PROFILE_DOUBLE, steps, ref);
+
+	for (p = STEP_PROFILE_DOUBLE; p <= STEP_PROFILE_SCURVE; p++) {
+		elapsed = run_profile(p, steps, NULL);
+		run_profile(p, steps, intervals);
+
+		max_err = 0;
+		for (i = 0; i < n; i++) {
+			err = labs((long)intervals[i] - (long)ref[i]);
+			if (err > max_err) {
+				max_err = err;
+			}
+		}
+
+		printf("%-8s %8.2f Mticks/s %7.2f ns/tick  max error vs double: %ld ticks%s\n",
+		       names[p], (n * 1000.0) / elapsed, (double)elapsed / n, max_err,
+		       p == STEP_PROFILE_TABLE ? " (exact ramp)" :
+		       p == STEP_PROFILE_SCURVE ? " (jerk-limited)" : "");
+	}
+
+	free(ref);
+	free(intervals);
+
+	return 0;
+}
+
+/*
+ * Wraps a source, and measures the interval between its rising edges. It
+ * only sees single events, so the source mustn't use fill() or get_run().
+ */
+struct probe_source {
+	struct source base;
+	struct source *inner;
+
+	/* Ticks since the last rising edge */
+	uint32_t since;
+	bool seen;
+
+	uint64_t steps;
+	uint64_t ticks;
+	uint32_t min;
+	uint32_t max;
+};
+
+static int probe_source_delay(struct source *s)
+{
+	struct probe_source *ps = (struct probe_source *)s;
+	int delay = ps->inner->get_delay(ps->inner);
+
+	ps->since += delay < 1 ? 1 : delay;
+
+	return delay;
+}
+
+static void probe_source_event(struct source *s, struct event *ev)
+{
+	struct probe_source *ps = (struct probe_source *)s;
+
+	ps->inner->gen_event(ps->inner, ev);
+	if (ev->type != EVENT_RISING_EDGE) {
+		return;
+	}
+
+	if (ps->seen) {
+		ps->steps++;
+		ps->ticks += ps->since;
+		ps->min = ps->since < ps->min ? ps->since : ps->min;
+		ps->max = ps->since > ps->max ? ps->since : ps->max;
+	}
+	ps->seen = true;
+	ps->since = 0;
+}
+
+/* Long-run speed error and interval jitter of a source at constant speed */
+static int bench_speed_error(int chunks)
+{
+	struct count_backend *cb;
+	struct step_source *ss;
+	struct probe_source ps;
+	struct wave_ctx ctx;
+	double speed, ideal, avg;
+	int i, ret = 0;
+
+	printf("== Speed error and jitter (%d x %d-tick chunks per speed) ==\n",
+	       chunks, BENCH_BUDGET);
+
+	for (speed = 20; speed <= 200 && !ret; speed *= 1.5) {
+		cb = count_backend_create();
+		ss = step_source_create(0);
+		ctx = (struct wave_ctx){ 0 };
+		ps = (struct probe_source){
+			.base = {
+				.get_delay = probe_source_delay,
+				.gen_event = probe_source_event,
+			},
+			.min = UINT32_MAX,
+		};
+		if (!cb || !ss) {
+			ret = -1;
+			goto next;
+		}
+
+		ss->base.fill = NULL;
+		ss->base.get_run = NULL;
+		ps.inner = &ss->base;
+		ctx.be = &cb->base;
+		if (wave_ctx_add_source(&ctx, &ps.base)) {
+			ret = -1;
+			goto next;
+		}
+		step_source_set_speed(&ss->base, speed);
+
+		/* Get up to speed before measuring */
+		for (i = 0; i < 200; i++) {
+			wave_gen(&ctx, BENCH_BUDGET);
+		}
+		ps.seen = false;
+		ps.steps = ps.ticks = 0;
+		ps.min = UINT32_MAX;
+		ps.max = 0;
+
+		for (i = 0; i < chunks; i++) {
+			wave_gen(&ctx, BENCH_BUDGET);
+		}
+
+		ideal = (2 * M_PI / 600) * 100000 / speed;
+		avg = (double)ps.ticks / ps.steps;
+		printf("%6.1f rad/s  ideal %8.3f  avg %10.5f ticks  error %+9.5f%%  "
+		       "(truncating: %+7.3f%%)  jitter %u..%u\n",
+		       speed, ideal, avg, (avg - ideal) * 100 / ideal,
+		       (floor(ideal) - ideal) * 100 / ideal, ps.min, ps.max);
+
+next:
+		wave_ctx_fini(&ctx);
+		if (ss) {
+			step_source_destroy(ss);
+		}
+		if (cb) {
+			count_backend_destroy(cb);
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Run n steppers at constant speeds for chunks, into be. If counted is set,
+ * it's reset once the steppers are up to speed, so it only counts the timed
+ * chunks. Returns the time taken in ns, or 0 on failure.
+ */
+static uint64_t run_steppers(struct wave_backend *be, int n, int chunks,
+			     struct count_backend *counted)
+{
+	struct step_source **steps;
+	struct wave_ctx ctx = { .be = be };
+	uint64_t start, elapsed = 0;
+	int i;
+
+	steps = calloc(n, sizeof(*steps));
+	if (!steps) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		steps[i] = step_source_create(i % 32);
+		if (!steps[i] || wave_ctx_add_source(&ctx, &steps[i]->base)) {
+			goto done;
+		}
+		step_source_set_speed(&steps[i]->base, 40 + (i % 32) * 3);
+	}
+
+	/* Get up to speed before measuring */
+	for (i = 0; i < 200; i++) {
+		wave_gen(&ctx, BENCH_BUDGET);
+	}
+	if (counted) {
+		count_backend_reset(counted);
+	}
+
+	start = now_ns();
+	for (i = 0; i < chunks; i++) {
+		wave_gen(&ctx, BENCH_BUDGET);
+	}
+	elapsed = now_ns() - start;
+
+done:
+	wave_ctx_fini(&ctx);
+	for (i = 0; i < n; i++) {
+		if (steps[i]) {
+			step_source_destroy(steps[i]);
+		}
+	}
+	free(steps);
+
+	return elapsed;
+}
+
+/* Length of axis i's moves in bench_linear(). Axis 0 is the dominant one */
+static int32_t linear_axis_len(int i)
+{
+	return 20000 - (i * 2000);
+}
+
+/*
+ * Shuttle n axes back and forth along a line, either with one linear_source
+ * or with a step_source per axis, each with its speed and acceleration
+ * scaled to its share of the move. Returns the time taken in ns, or 0 on
+ * failure.
+ */
+static uint64_t run_linear(struct count_backend *cb, int n, int chunks, bool linear)
+{
+	struct linear_source *ls = NULL;
+	struct step_source *steps[8] = { NULL };
+	struct wave_ctx ctx = { .be = &cb->base };
+	int channels[8];
+	int32_t target[8];
+	uint64_t start, elapsed = 0;
+	int i, c, sign = 1;
+	bool busy;
+
+	for (i = 0; i < n; i++) {
+		channels[i] = i;
+	}
+
+	if (linear) {
+		ls = linear_source_create(n, channels);
+		if (!ls || wave_ctx_add_source(&ctx, &ls->base)) {
+			goto done;
+		}
+	} else {
+		for (i = 0; i < n; i++) {
+			steps[i] = step_source_create(channels[i]);
+			if (!steps[i] || wave_ctx_add_source(&ctx, &steps[i]->base)) {
+				goto done;
+			}
+		}
+	}
+
+	count_backend_reset(cb);
+	for (c = 0; c < chunks; c++) {
+		busy = ls && linear_source_busy(&ls->base);
+		for (i = 0; i < n && steps[i]; i++) {
+			busy |= steps[i]->n_moves != 0;
+		}
+
+		if (!busy) {
+			sign = -sign;
+			for (i = 0; i < n; i++) {
+				double share = (double)linear_axis_len(i) / linear_axis_len(0);
+
+				target[i] = sign * linear_axis_len(i) / 2;
+				if (!ls && step_source_queue_move(&steps[i]->base, target[i],
+								  40 * share, 200 * share)) {
+					goto done;
+				}
+			}
+			if (ls && linear_source_move(&ls->base, target, 40, 200)) {
+				goto done;
+			}
+		}
+
+		start = now_ns();
+		wave_gen(&ctx, BENCH_BUDGET);
+		elapsed += now_ns() - start;
+	}
+
+done:
+	wave_ctx_fini(&ctx);
+	if (ls) {
+		linear_source_destroy(ls);
+	}
+	for (i = 0; i < n; i++) {
+		if (steps[i]) {
+			step_source_destroy(steps[i]);
+		}
+	}
+
+	return elapsed;
+}
+
+/* One n-axis linear_source against n separate step_sources */
+static int bench_linear(int chunks)
+{
+	static const int axes[] = { 2, 4, 8 };
+	struct count_backend *cb;
+	unsigned int i;
+	int linear;
+
+	printf("== Linear moves (%d x %d-tick chunks) ==\n", chunks, BENCH_BUDGET);
+
+	cb = count_backend_create();
+	if (!cb) {
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(axes) / sizeof(axes[0]); i++) {
+		for (linear = 1; linear >= 0; linear--) {
+			uint64_t ns = run_linear(cb, axes[i], chunks, linear);
+			if (!ns || !cb->edges) {
+				count_backend_destroy(cb);
+				return -1;
+			}
+
+			printf("%d axes  %-13s %9.2f Medges/s %7.1f ns/edge  %5.2f events/edge\n",
+			       axes[i], linear ? "linear_source" : "step_sources",
+			       (cb->edges * 1000.0) / ns, (double)ns / cb->edges,
+			       (double)cb->events / cb->edges);
+		}
+	}
+
+	count_backend_destroy(cb);
+
+	return 0;
+}
+
+/* VCD writer throughput, writing to /dev/null */
+static int bench_vcd(int chunks)
+{
+	struct count_backend *cb = NULL;
+	struct vcd_backend *vb = NULL;
+	uint64_t base_ns, vcd_ns;
+	FILE *fp;
+	int ret = -1;
+
+	printf("== VCD output (%d x %d-tick chunks, 32 steppers) ==\n", chunks, BENCH_BUDGET);
+
+	fp = fopen("/dev/null", "w");
+	cb = count_backend_create();
+	if (!fp || !cb) {
+		goto fail;
+	}
+
+	/*
+	 * The same waveform again, just to count the edges and wave_gen's
+	 * share. The first run is only to warm up.
+	 */
+	if (!run_steppers(&cb->base, 32, chunks, NULL)) {
+		goto fail;
+	}
+	base_ns = run_steppers(&cb->base, 32, chunks, cb);
+
+	vb = vcd_backend_create(0xffffffff, fp);
+	if (!vb) {
+		goto fail;
+	}
+	vcd_ns = run_steppers(&vb->base, 32, chunks, NULL);
+	if (!base_ns || !vcd_ns) {
+		goto fail;
+	}
+	vcd_backend_flush(vb);
+
+	printf("%9.2f Medges/s %7.1f ns/edge, %7.1f ns/edge in the writer, %.1f MB/s\n",
+	       (cb->edges * 1000.0) / vcd_ns, (double)vcd_ns / cb->edges,
+	       ((double)vcd_ns - base_ns) / cb->edges,
+	       (vb->bytes * 1000.0) / vcd_ns);
+
+	ret = 0;
+
+fail:
+	if (vb) {
+		vcd_backend_fini(vb);
+	}
+	if (cb) {
+		count_backend_destroy(cb);
+	}
+	if (fp) {
+		fclose(fp);
+	}
+
+	return ret;
+}
+
+/*
+ * Cost of recording through tee_backend, as seen by wave_gen's thread, with
+ * a VCD writer to /dev/null draining the ring
+ */
+static int bench_tee(int chunks)
+{
+	struct count_backend *cb = NULL;
+	struct vcd_backend *vb = NULL;
+	struct tee_backend *tb = NULL;
+	uint64_t base_ns, tee_ns, dropped;
+	FILE *fp;
+	int ret = -1;
+
+	printf("== Recording tee (%d x %d-tick chunks, 32 steppers) ==\n", chunks, BENCH_BUDGET);
+
+	fp = fopen("/dev/null", "w");
+	cb = count_backend_create();
+	if (!fp || !cb) {
+		goto fail;
+	}
+	base_ns = run_steppers(&cb->base, 32, chunks, cb);
+
+	vb = vcd_backend_create(0xffffffff, fp);
+	if (!vb) {
+		goto fail;
+	}
+	tb = tee_backend_create(&cb->base, &vb->base, TEE_RING_LEN);
+	if (!tb) {
+		goto fail;
+	}
+
+	tee_ns = run_steppers(&tb->base, 32, chunks, cb);
+	dropped = tb->dropped;
+	tee_backend_fini(tb);
+	if (!base_ns || !tee_ns) {
+		goto fail;
+	}
+
+	printf("%9.2f Medges/s %7.1f ns/edge, %7.1f ns/edge for the tee, %llu slots dropped\n",
+	       (cb->edges * 1000.0) / tee_ns, (double)tee_ns / cb->edges,
+	       ((double)tee_ns - base_ns) / cb->edges, (unsigned long long)dropped);
+
+	ret = 0;
+
+fail:
+	if (vb) {
+		vcd_backend_fini(vb);
+	}
+	if (cb) {
+		count_backend_destroy(cb);
+	}
+	if (fp) {
+		fclose(fp);
+	}
+
+	return ret;
+}
+
+/*
+ * Per-stage cost of pipe_backend, with count_backend standing in for the
+ * encoder's primary
+ */
+static int bench_pipe(int chunks)
+{
+	struct count_backend *cb;
+	struct pipe_backend *pb;
+	struct pipe_stats stats;
+	uint64_t base_ns, pipe_ns, edges;
+
+	printf("== Pipelined generation (%d x %d-tick chunks, 32 steppers) ==\n",
+	       chunks, BENCH_BUDGET);
+
+	cb = count_backend_create();
+	if (!cb) {
+		return -1;
+	}
+	base_ns = run_steppers(&cb->base, 32, chunks, cb);
+	edges = cb->edges;
+
+	pb = pipe_backend_create(&cb->base, NULL, NULL);
+	if (!pb) {
+		count_backend_destroy(cb);
+		return -1;
+	}
+	pipe_ns = run_steppers(&pb->base, 32, chunks, NULL);
+	pipe_backend_sync(pb, 1000);
+	pipe_backend_get_stats(pb, &stats);
+	pipe_backend_fini(pb);
+	count_backend_destroy(cb);
+	if (!base_ns || !pipe_ns) {
+		return -1;
+	}
+
+	printf("direct %7.1f ns/edge, pipelined %7.1f ns/edge\n",
+	       (double)base_ns / edges, (double)pipe_ns / edges);
+	printf("per chunk: generate %.1f us, stall %.1f us, wait %.1f us, encode %.1f us, %.0f slots\n",
+	       stats.gen_ns / (stats.chunks * 1000.0), stats.stall_ns / (stats.chunks * 1000.0),
+	       stats.wait_ns / (stats.chunks * 1000.0), stats.encode_ns / (stats.chunks * 1000.0),
+	       (double)stats.slots / stats.chunks);
+
+	return 0;
+}
+
+/* Generate chunks into pi_backend, waiting for a segment each time */
+static int bench_pi_chunks(struct pi_backend *be, struct wave_ctx *ctx, int chunks)
+{
+	int i;
+
+	for (i = 0; i < chunks; i++) {
+		if (pi_backend_wait_fence_precise(be, 1000)) {
+			fprintf(stderr, "Timeout waiting for pi_sim\n");
+			return -1;
+		}
+		wave_gen(ctx, BENCH_BUDGET);
+	}
+
+	return 0;
+}
+
+/*
+ * Time pi_backend takes to build each chunk, from start_wave to end_wave
+ * (so including wave_gen), with the current settings
+ */
+static int bench_pi_build(struct pi_backend *be, struct wave_ctx *ctx,
+			  const char *name)
+{
+	struct pi_backend_stats before, after;
+	uint64_t builds, cbs;
+
+	pi_backend_get_stats(be, &before);
+	if (bench_pi_chunks(be, ctx, PI_BENCH_CHUNKS)) {
+		return -1;
+	}
+	pi_backend_get_stats(be, &after);
+
+	builds = after.builds - before.builds;
+	cbs = after.build_cbs - before.build_cbs;
+	printf("%-18s %7.1f us/chunk %6.1f ns/CB %6.0f CBs/chunk  %u truncated\n",
+	       name, (after.build_ns - before.build_ns) / (builds * 1000.0),
+	       (double)(after.build_ns - before.build_ns) / cbs,
+	       (double)cbs / builds, after.truncated - before.truncated);
+
+	return 0;
+}
+
+/*
+ * pi_backend's build cost for each encoding, built for the host against
+ * pi_sim. pi_sim's
+ * "uncached" DMA memory is ordinary memory, so direct builds don't pay
+ * what they would on a Pi, and staged ones only show the copy's overhead.
+ */
+static int bench_pi(void)
+{
+	static const struct {
+		const char *name;
+		enum pi_encoding encoding;
+	} encodings[] = {
+		{ "set-clear", PI_ENCODING_SET_CLEAR },
+		{ "sparse", PI_ENCODING_SPARSE },
+		{ "dense", PI_ENCODING_DENSE },
+	};
+	struct square_wave_source squares[2] = {
+		{ .period = 100, .pin = 16 },
+		{ .period = 30, .pin = 19 },
+	};
+	struct step_source *steps[4] = { NULL };
+	struct wave_ctx ctx = { 0 };
+	struct board_cfg board;
+	struct gpio_dev *gpio = NULL;
+	struct pi_backend *be = NULL;
+	int i, ret = -1;
+
+	printf("== pi_backend on pi_sim (%d x %d-tick chunks, 4 steppers, 2 square waves) ==\n",
+	       PI_BENCH_CHUNKS, BENCH_BUDGET);
+
+	if (get_model_and_revision(&board)) {
+		goto fail;
+	}
+	gpio = gpio_init(&board);
+	if (!gpio) {
+		goto fail;
+	}
+	be = pi_backend_create(&board, gpio, 2);
+	if (!be) {
+		goto fail;
+	}
+	ctx.be = (struct wave_backend *)be;
+
+	for (i = 0; i < 2; i++) {
+		squares[i].base.get_delay = square_wave_source_delay;
+		squares[i].base.gen_event = square_wave_source_event;
+		squares[i].base.fill = square_wave_source_fill;
+		if (wave_ctx_add_source(&ctx, &squares[i].base)) {
+			goto fail;
+		}
+	}
+
+	for (i = 0; i < 4; i++) {
+		steps[i] = step_source_create(20 + i);
+		if (!steps[i] || wave_ctx_add_source(&ctx, &steps[i]->base)) {
+			goto fail;
+		}
+		step_source_set_speed(&steps[i]->base, 8 + i * 2);
+	}
+
+	/* Let the steppers get up to speed */
+	if (bench_pi_chunks(be, &ctx, 50)) {
+		goto fail;
+	}
+
+	/* Each encoding, staged and then direct */
+	for (i = 0; i < 6; i++) {
+		bool staged = !(i & 1);
+		char name[32];
+
+		snprintf(name, sizeof(name), "%s %s", encodings[i / 2].name,
+			 staged ? "staged" : "direct");
+		pi_backend_set_encoding(be, encodings[i / 2].encoding);
+		if (pi_backend_set_staging(be, staged) ||
+		    bench_pi_build(be, &ctx, name)) {
+			goto fail;
+		}
+	}
+
+	ret = 0;
+
+fail:
+	wave_ctx_fini(&ctx);
+	for (i = 0; i < 4; i++) {
+		if (steps[i]) {
+			step_source_destroy(steps[i]);
+		}
+	}
+	if (be) {
+		pi_backend_destroy(be);
+	}
+	if (gpio) {
+		gpio_fini(gpio);
+	}
+
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-q squares] [-s steps] [-c chunks] [-p profile] [-n] [-r] [-d]\n", prog);
+	fprintf(stderr, "With no -q or -s, runs the whole suite\n");
+	fprintf(stderr, "  -q N  Number of square wave sources\n");
+	fprintf(stderr, "  -s N  Number of step sources\n");
+	fprintf(stderr, "  -c N  Number of %d-tick chunks\n", BENCH_BUDGET);
+	fprintf(stderr, "  -p N  Step profile (0 double, 1 fixed, 2 table, 3 scurve)\n");
+	fprintf(stderr, "  -n    Don't use fill()\n");
+	fprintf(stderr, "  -r    Don't use step runs\n");
+	fprintf(stderr, "  -d    Dual-edge stepping\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct mix mix = {
+		.chunks = 2000,
+		.fill = true,
+		.runs = true,
+		.profile = STEP_PROFILE_TABLE,
+	};
+	bool runs_ok;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "q:s:c:p:nrdh")) != -1) {
+		switch (opt) {
+		case 'q':
+			mix.n_square = atoi(optarg);
+			break;
+		case 's':
+			mix.n_step = atoi(optarg);
+			break;
+		case 'c':
+			mix.chunks = atoi(optarg);
+			break;
+		case 'p':
+			mix.profile = atoi(optarg);
+			break;
+		case 'n':
+			mix.fill = false;
+			break;
+		case 'r':
+			mix.runs = false;
+			break;
+		case 'd':
+			mix.dual_edge = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (mix.n_square || mix.n_step) {
+		return bench_mix(&mix) ? 1 : 0;
+	}
+
+	/* Carry on after a bad bench_sources() row, but still fail at the end */
+	runs_ok = !bench_sources(mix.chunks);
+	if (bench_profiles(20000) || bench_speed_error(mix.chunks) ||
+	    bench_linear(mix.chunks) ||
+	    bench_vcd(mix.chunks) || bench_tee(mix.chunks) ||
+	    bench_pipe(mix.chunks) || bench_pi()) {
+		return 1;
+	}
+
+	return runs_ok ? 0 : 1;
+}
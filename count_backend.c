@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "count_backend.h"
+#include "types.h"
+
+static void count_backend_emit_event(struct wave_backend *wb, const struct event *ev)
+{
+	struct count_backend *cb = (struct count_backend *)wb;
+
+	cb->events++;
+
+	switch (ev->type) {
+	case EVENT_RISING_EDGE:
+		cb->rising |= (1 << ev->channel);
+		break;
+	case EVENT_FALLING_EDGE:
+	case EVENT_TOGGLE:
+		cb->falling |= (1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		cb->rising |= ev->rising;
+		cb->falling |= ev->falling;
+		break;
+	case EVENT_NONE:
+		break;
+	}
+}
+
+static void count_backend_add_event(struct wave_backend *wb, struct source *s)
+{
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	count_backend_emit_event(wb, &ev);
+}
+
+static void count_backend_add_delay(struct wave_backend *wb, int delay)
+{
+	struct count_backend *cb = (struct count_backend *)wb;
+
+	if (cb->rising || cb->falling) {
+		cb->busy_slots++;
+		cb->edges += __builtin_popcount(cb->rising) +
+			     __builtin_popcount(cb->falling);
+	}
+
+	cb->slots++;
+	cb->ticks += delay;
+	cb->rising = cb->falling = 0;
+}
+
+static int count_backend_add_run(struct wave_backend *wb, struct step_run *run, int limit)
+{
+	struct count_backend *cb = (struct count_backend *)wb;
+	int edges = run->pulsewidth ? 2 : 1;
+	int ticks = 0;
+
+	while (run->count) {
+		int interval = step_run_interval(run);
+		int delay = step_run_clip(run, ticks, limit);
+
+		if (!delay) {
+			break;
+		}
+
+		ticks += interval;
+		step_run_advance(run);
+
+		cb->run_steps++;
+		cb->edges += edges;
+		cb->slots += edges;
+		cb->busy_slots += edges;
+		cb->ticks += delay;
+	}
+
+	if (ticks) {
+		cb->runs++;
+	}
+
+	return ticks;
+}
+
+void count_backend_reset(struct count_backend *cb)
+{
+	struct wave_backend base = cb->base;
+
+	memset(cb, 0, sizeof(*cb));
+	cb->base = base;
+}
+
+struct count_backend *count_backend_create(void)
+{
+	struct count_backend *cb = calloc(1, sizeof(*cb));
+	if (!cb) {
+		return NULL;
+	}
+
+	cb->base.add_delay = count_backend_add_delay;
+	cb->base.add_event = count_backend_add_event;
+	cb->base.emit_event = count_backend_emit_event;
+	cb->base.add_run = count_backend_add_run;
+
+	return cb;
+}
+
+void count_backend_destroy(struct count_backend *cb)
+{
+	free(cb);
+}
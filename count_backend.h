@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __COUNT_BACKEND_H__
+#define __COUNT_BACKEND_H__
+#include <stdint.h>
+
+#include "wave_gen.h"
+
+/*
+ * A backend which just counts what it's given, for measuring wave_gen and
+ * the sources on their own.
+ */
+struct count_backend {
+	struct wave_backend base;
+
+	/* Slots, i.e. calls to add_delay() */
+	uint64_t slots;
+	/* Slots which had at least one edge */
+	uint64_t busy_slots;
+	/* Events, including EVENT_NONE */
+	uint64_t events;
+	/* Individual pin transitions */
+	uint64_t edges;
+	uint64_t ticks;
+	uint64_t runs;
+	uint64_t run_steps;
+
+	/* Edges in the current slot */
+	uint32_t rising;
+	uint32_t falling;
+};
+
+struct count_backend *count_backend_create(void);
+void count_backend_reset(struct count_backend *cb);
+void count_backend_destroy(struct count_backend *cb);
+
+#endif /* __COUNT_BACKEND_H__ */
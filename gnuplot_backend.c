@@ -17,57 +17,234 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "gnuplot_backend.h"
 #include "types.h"
 
-static void gnuplot_backend_add_event(struct wave_backend *wb, struct source *s)
+static void gnuplot_backend_emit_event(struct wave_backend *wb, const struct event *ev)
 {
 	struct gnuplot_backend *gb = (struct gnuplot_backend *)wb;
-	struct event ev;
 
-	s->gen_event(s, &ev);
-
-	switch (ev.type) {
+	switch (ev->type) {
 	case EVENT_RISING_EDGE:
-		gb->state |= (1 << ev.channel);
+		gb->state |= (1 << ev->channel);
 		break;
 	case EVENT_FALLING_EDGE:
-		gb->state &= ~(1 << ev.channel);
+		gb->state &= ~(1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		gb->state |= ev->rising;
+		gb->state &= ~ev->falling;
+		break;
+	case EVENT_TOGGLE:
+		gb->state ^= (1 << ev->channel);
+		break;
+	case EVENT_NONE:
 		break;
 	}
 }
 
-static void print_state(int time, uint32_t state)
+static void gnuplot_backend_add_event(struct wave_backend *wb, struct source *s)
 {
-	int i;
-	printf("%d, ", time);
-	for (i = 0; i < 4; i++) {
-		printf("%c, ", state & (1 << i) ? '1' : '0');
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	gnuplot_backend_emit_event(wb, &ev);
+}
+
+static char *gnuplot_put_u64(char *p, uint64_t val)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+
+	while (n) {
+		*p++ = tmp[--n];
+	}
+
+	return p;
+}
+
+static void gnuplot_backend_write(struct gnuplot_backend *gb)
+{
+	fwrite(gb->buf, 1, gb->len, gb->fp);
+	gb->len = 0;
+}
+
+/*
+ * Write a row with the level of each pin in high. Pins in low but not high
+ * get a 0 column first, for the bottom of the envelope.
+ */
+static void print_row(struct gnuplot_backend *gb, uint64_t time, uint32_t low,
+		      uint32_t high)
+{
+	uint32_t mask = gb->pins;
+	char *p;
+
+	/* Time, and at most two columns for each pin */
+	if (gb->len > GNUPLOT_BUF_SIZE - (22 + (32 * 6) + 1)) {
+		gnuplot_backend_write(gb);
+	}
+
+	p = gb->buf + gb->len;
+	p = gnuplot_put_u64(p, time);
+	*p++ = ',';
+	*p++ = ' ';
+	while (mask) {
+		uint32_t bit = mask & -mask;
+
+		if (gb->window) {
+			*p++ = (low & bit) ? '0' : '1';
+			*p++ = ',';
+			*p++ = ' ';
+		}
+		*p++ = (high & bit) ? '1' : '0';
+		*p++ = ',';
+		*p++ = ' ';
+
+		mask &= mask - 1;
+	}
+	*p++ = '\n';
+	gb->len = p - gb->buf;
+}
+
+/* Write a row for every change, holding the old levels until just before it */
+static void gnuplot_backend_add_row(struct gnuplot_backend *gb)
+{
+	uint32_t state = gb->state & gb->pins;
+
+	if (gb->started && state == gb->prev_state) {
+		return;
+	}
+
+	if (gb->started && gb->prev_time < gb->time - 1) {
+		print_row(gb, gb->time - 1, ~gb->prev_state, gb->prev_state);
+	}
+	print_row(gb, gb->time, ~state, state);
+
+	gb->started = true;
+	gb->prev_time = gb->time;
+	gb->prev_state = state;
+}
+
+/* Finish the current window, writing a row if its envelope changed */
+static void gnuplot_backend_end_window(struct gnuplot_backend *gb)
+{
+	if (gb->started && gb->win_low == gb->prev_low &&
+	    gb->win_high == gb->prev_high) {
+		return;
+	}
+
+	if (gb->started && gb->prev_time < gb->win_start - gb->window) {
+		print_row(gb, gb->win_start - 1, gb->prev_low, gb->prev_high);
+	}
+	print_row(gb, gb->win_start, gb->win_low, gb->win_high);
+
+	gb->started = true;
+	gb->prev_time = gb->win_start;
+	gb->prev_low = gb->win_low;
+	gb->prev_high = gb->win_high;
+}
+
+/* Add the levels from now until end to the window envelopes */
+static void gnuplot_backend_add_window(struct gnuplot_backend *gb, uint64_t end)
+{
+	uint32_t state = gb->state & gb->pins;
+	uint64_t t = gb->time;
+
+	while (t < end) {
+		if (t >= gb->win_start + gb->window) {
+			gnuplot_backend_end_window(gb);
+			gb->win_start = t - (t % gb->window);
+			gb->win_low = gb->win_high = 0;
+		}
+
+		gb->win_low |= ~state & gb->pins;
+		gb->win_high |= state;
+
+		t = gb->win_start + gb->window;
 	}
-	printf("\n");
 }
 
 static void gnuplot_backend_add_delay(struct wave_backend *wb, int delay)
 {
 	struct gnuplot_backend *gb = (struct gnuplot_backend *)wb;
 
-	if (gb->prev_time < gb->time - 1) {
-		print_state(gb->time - 1, gb->prev_state);
+	if (gb->window) {
+		gnuplot_backend_add_window(gb, gb->time + delay);
+	} else {
+		gnuplot_backend_add_row(gb);
 	}
-	print_state(gb->time, gb->state);
 
-	gb->prev_time = gb->time;
-	gb->prev_state = gb->state;
 	gb->time += delay;
 }
 
-struct gnuplot_backend *gnuplot_backend_create()
+static void gnuplot_backend_end_wave(struct wave_backend *wb)
+{
+	struct gnuplot_backend *gb = (struct gnuplot_backend *)wb;
+
+	gnuplot_backend_write(gb);
+	fflush(gb->fp);
+}
+
+/* Finish off the last row or window, so the plot runs up to the current time */
+void gnuplot_backend_fini(struct gnuplot_backend *gb)
+{
+	if (gb->buf) {
+		if (gb->window && gb->time) {
+			gnuplot_backend_end_window(gb);
+			print_row(gb, gb->time, gb->prev_low, gb->prev_high);
+		} else if (gb->started) {
+			print_row(gb, gb->time, ~gb->prev_state, gb->prev_state);
+		}
+		gnuplot_backend_write(gb);
+		fflush(gb->fp);
+	}
+	free(gb->buf);
+	free(gb);
+}
+
+struct gnuplot_backend *gnuplot_backend_create(uint32_t pins, FILE *fp, int window)
 {
 	struct gnuplot_backend *gb = calloc(1, sizeof(*gb));
+	int i;
+
+	if (!gb) {
+		return NULL;
+	}
 
+	gb->buf = malloc(GNUPLOT_BUF_SIZE);
+	if (!gb->buf) {
+		free(gb);
+		return NULL;
+	}
+
+	gb->fp = fp;
+	gb->pins = pins;
+	gb->window = window;
 	gb->base.add_delay = gnuplot_backend_add_delay;
 	gb->base.add_event = gnuplot_backend_add_event;
+	gb->base.emit_event = gnuplot_backend_emit_event;
+	gb->base.end_wave = gnuplot_backend_end_wave;
+
+	/* gnuplot skips lines starting with '#' */
+	fprintf(fp, "# time");
+	for (i = 0; i < 32; i++) {
+		if (!(pins & (1 << i))) {
+			continue;
+		}
+		if (window) {
+			fprintf(fp, ", pin%d min, pin%d max", i, i);
+		} else {
+			fprintf(fp, ", pin%d", i);
+		}
+	}
+	fprintf(fp, "\n");
 
 	return gb;
 }
@@ -16,19 +16,51 @@
  */
 #ifndef __GNUPLOT_BACKEND_H__
 #define __GNUPLOT_BACKEND_H__
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "wave_gen.h"
 
+#define GNUPLOT_BUF_SIZE (256 * 1024)
+
+/*
+ * Writes one row per change as "time, pin, pin, ...", with a column for each
+ * pin in the mask, in pin order.
+ *
+ * With a window, time is split into windows of that many ticks instead, and
+ * there are two columns per pin: the lowest and highest level it had in the
+ * window. A row is only written when that envelope changes, so a trace of
+ * steady stepping stays the same size however long it runs.
+ */
 struct gnuplot_backend {
 	struct wave_backend base;
 
-	int time;
-	int prev_time;
+	FILE *fp;
+	uint32_t pins;
+	int window;
+
+	/* Output waiting to be written to fp */
+	char *buf;
+	int len;
+
+	uint64_t time;
 	uint32_t state;
+
+	/* The last row written, or prev_low/prev_high with a window */
+	bool started;
+	uint64_t prev_time;
 	uint32_t prev_state;
+
+	/* Pins which were low/high at some point in the current window */
+	uint64_t win_start;
+	uint32_t win_low;
+	uint32_t win_high;
+	uint32_t prev_low;
+	uint32_t prev_high;
 };
 
-struct gnuplot_backend *gnuplot_backend_create();
+struct gnuplot_backend *gnuplot_backend_create(uint32_t pins, FILE *fp, int window);
+void gnuplot_backend_fini(struct gnuplot_backend *gb);
 
 #endif /* __GNUPLOT_BACKEND_H__ */
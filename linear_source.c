@@ -0,0 +1,259 @@
+/*
+ * linear_source.c Coordinated multi-axis stepper motor event source
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <math.h>
+#include <stdlib.h>
+
+#include "linear_source.h"
+#include "types.h"
+
+#define STEPS_PER_REV 600
+#define TIMER_FREQ    100000
+
+/* Advance the DDA by one dominant-axis step, and work out which axes step */
+static uint32_t linear_source_dda(struct linear_source *ls)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 0; i < ls->n_axes; i++) {
+		struct linear_axis *ax = &ls->axes[i];
+
+		ax->err += ax->delta;
+		if (ax->err >= ls->steps) {
+			ax->err -= ls->steps;
+			ax->pos += ax->dir;
+			mask |= (1 << ax->channel);
+		}
+	}
+
+	ls->done++;
+
+	return mask;
+}
+
+static void linear_source_finish(struct linear_source *ls)
+{
+	step_ramp_put(ls->ramp);
+	ls->ramp = NULL;
+	ls->ramp_n = 0;
+}
+
+static int linear_source_get_delay(struct source *s)
+{
+	struct linear_source *ls = (struct linear_source *)s;
+
+	switch (ls->state) {
+	case LINEAR_RISING:
+		ls->state = LINEAR_FALLING;
+		if (ls->done < ls->steps) {
+			uint64_t c = step_ramp_interval(ls->ramp, &ls->ramp_n, ls->n_max, 0,
+							ls->c_cruise, ls->steps - ls->done);
+			c += ls->residual;
+			ls->residual = (uint32_t)c;
+			ls->gap = c >> STEP_FIXED_SHIFT;
+		}
+		return ls->pulsewidth;
+	case LINEAR_FALLING:
+		if (ls->done == ls->steps) {
+			linear_source_finish(ls);
+			ls->state = LINEAR_IDLE;
+			ls->idle = true;
+			return SOURCE_DELAY_IDLE;
+		}
+		ls->state = LINEAR_RISING;
+		ls->step_mask = linear_source_dda(ls);
+		return ls->gap - ls->pulsewidth;
+	case LINEAR_DIR:
+		ls->state = LINEAR_RISING;
+		ls->step_mask = linear_source_dda(ls);
+		return ls->dir_setup;
+	case LINEAR_IDLE:
+	default:
+		/* Nothing to do until linear_source_move() */
+		ls->idle = true;
+		return SOURCE_DELAY_IDLE;
+	}
+}
+
+static void linear_source_gen_event(struct source *s, struct event *ev)
+{
+	struct linear_source *ls = (struct linear_source *)s;
+
+	ev->channel = -1;
+	ev->rising = 0;
+	ev->falling = 0;
+
+	switch (ls->state) {
+	case LINEAR_RISING:
+		ev->type = EVENT_EDGES;
+		ev->rising = ls->step_mask;
+		break;
+	case LINEAR_FALLING:
+		ev->type = EVENT_EDGES;
+		ev->falling = ls->step_mask;
+		break;
+	case LINEAR_DIR:
+		ev->type = EVENT_EDGES;
+		ev->rising = ls->dir_set;
+		ev->falling = ls->dir_clear;
+		break;
+	case LINEAR_IDLE:
+	default:
+		ev->type = EVENT_NONE;
+		break;
+	}
+}
+
+struct linear_source *linear_source_create(int n_axes, const int *channels)
+{
+	struct linear_source *ls = calloc(1, sizeof(*ls));
+	int i;
+
+	if (!ls) {
+		return NULL;
+	}
+
+	ls->axes = calloc(n_axes, sizeof(*ls->axes));
+	if (!ls->axes) {
+		free(ls);
+		return NULL;
+	}
+
+	for (i = 0; i < n_axes; i++) {
+		ls->axes[i].channel = channels[i];
+		ls->axes[i].dir_channel = -1;
+	}
+
+	ls->base.gen_event = linear_source_gen_event;
+	ls->base.get_delay = linear_source_get_delay;
+	ls->n_axes = n_axes;
+	ls->pulsewidth = 5;
+	ls->dir_setup = 1;
+	ls->alpha = (2 * M_PI) / STEPS_PER_REV;
+	ls->f = TIMER_FREQ;
+
+	return ls;
+}
+
+void linear_source_destroy(struct linear_source *ls)
+{
+	if (ls->ramp) {
+		linear_source_finish(ls);
+	}
+	free(ls->axes);
+	free(ls);
+}
+
+void linear_source_set_dir_channels(struct source *s, const int *channels,
+				    int setup_ticks)
+{
+	struct linear_source *ls = (struct linear_source *)s;
+	int i;
+
+	for (i = 0; i < ls->n_axes; i++) {
+		ls->axes[i].dir_channel = channels[i];
+	}
+	ls->dir_setup = setup_ticks;
+}
+
+int linear_source_move(struct source *s, const int32_t *target, double speed,
+		       double accel)
+{
+	struct linear_source *ls = (struct linear_source *)s;
+	struct step_ramp *ramp;
+	int32_t steps = 0;
+	int i;
+
+	if (ls->state != LINEAR_IDLE || speed <= 0 || accel <= 0) {
+		return -1;
+	}
+
+	for (i = 0; i < ls->n_axes; i++) {
+		int32_t delta = abs(target[i] - ls->axes[i].pos);
+		if (delta > steps) {
+			steps = delta;
+		}
+	}
+
+	if (!steps) {
+		return 0;
+	}
+
+	ramp = step_ramp_get(STEPS_PER_REV, TIMER_FREQ, accel);
+	if (!ramp) {
+		return -1;
+	}
+
+	ls->n_max = (speed * speed) / (2 * ls->alpha * accel);
+	if (step_ramp_reserve(ramp, ls->n_max + 1)) {
+		step_ramp_put(ramp);
+		return -1;
+	}
+
+	ls->ramp = ramp;
+	ls->ramp_n = 0;
+	ls->c_cruise = step_fixed_from_double((ls->alpha * ls->f) / speed);
+	ls->residual = 1U << (STEP_FIXED_SHIFT - 1);
+	ls->steps = steps;
+	ls->done = 0;
+
+	ls->dir_set = 0;
+	ls->dir_clear = 0;
+	for (i = 0; i < ls->n_axes; i++) {
+		struct linear_axis *ax = &ls->axes[i];
+
+		ax->dir = target[i] >= ax->pos ? 1 : -1;
+		ax->delta = abs(target[i] - ax->pos);
+		/* Start half way, so minor axis steps are centred */
+		ax->err = steps / 2;
+
+		if (ax->dir_channel >= 0) {
+			if (ax->dir > 0) {
+				ls->dir_set |= (1 << ax->dir_channel);
+			} else {
+				ls->dir_clear |= (1 << ax->dir_channel);
+			}
+		}
+	}
+
+	/* The move starts with the direction pins, as soon as wave_gen is back */
+	ls->state = LINEAR_DIR;
+	if (ls->idle && s->ctx) {
+		wave_ctx_wake_source(s->ctx, s);
+		ls->idle = false;
+	}
+
+	return 0;
+}
+
+int linear_source_busy(struct source *s)
+{
+	struct linear_source *ls = (struct linear_source *)s;
+
+	return ls->state != LINEAR_IDLE;
+}
+
+void linear_source_get_position(struct source *s, int32_t *pos)
+{
+	struct linear_source *ls = (struct linear_source *)s;
+	int i;
+
+	for (i = 0; i < ls->n_axes; i++) {
+		pos[i] = ls->axes[i].pos;
+	}
+}
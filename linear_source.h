@@ -0,0 +1,105 @@
+/*
+ * linear_source.h Coordinated multi-axis stepper motor event source
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __LINEAR_SOURCE_H__
+#define __LINEAR_SOURCE_H__
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wave_gen.h"
+#include "step_gen.h"
+
+/*
+ * A linear_source drives several step channels along straight lines. A
+ * single trapezoidal profile runs along the axis with the most steps
+ * (the dominant axis), and the other axes' steps are spread along it
+ * with a DDA. All the axes which step on the same tick are emitted as one
+ * EVENT_EDGES event, so the axes can't drift apart and wave_gen only
+ * schedules one source.
+ */
+
+enum linear_state {
+	LINEAR_IDLE,
+	LINEAR_DIR,
+	LINEAR_RISING,
+	LINEAR_FALLING,
+};
+
+struct linear_axis {
+	int channel;
+	/* Direction pin, or -1 if there isn't one */
+	int dir_channel;
+
+	int32_t pos;
+	int dir;
+
+	/* Steps in the current move, and DDA error accumulator */
+	int32_t delta;
+	int32_t err;
+};
+
+struct linear_source {
+	struct source base;
+
+	int pulsewidth;
+	int dir_setup;
+
+	int n_axes;
+	struct linear_axis *axes;
+
+	enum linear_state state;
+	/* Returned SOURCE_DELAY_IDLE, so wave_gen needs waking for the next move */
+	bool idle;
+	/* Axes stepping on the current tick */
+	uint32_t step_mask;
+	/* Direction pins to set and clear */
+	uint32_t dir_set, dir_clear;
+
+	/* Current move. steps is the dominant axis' step count */
+	struct step_ramp *ramp;
+	int32_t steps;
+	int32_t done;
+	int32_t ramp_n;
+	int32_t n_max;
+	/* Q32.32 ticks, with the fraction lost to rounding carried over */
+	uint64_t c_cruise;
+	uint32_t residual;
+	int gap;
+
+	double alpha;
+	double f;
+};
+
+struct linear_source *linear_source_create(int n_axes, const int *channels);
+void linear_source_destroy(struct linear_source *ls);
+
+/* Drive a direction pin per axis, high for positive moves. -1 for none */
+void linear_source_set_dir_channels(struct source *s, const int *channels,
+				    int setup_ticks);
+
+/*
+ * Start a move to the absolute positions in target, one per axis. speed
+ * (rad/s) and accel (rad/s^2) apply to the dominant axis.
+ *
+ * Returns -1 if a move is already in progress or the parameters are invalid.
+ */
+int linear_source_move(struct source *s, const int32_t *target, double speed,
+		       double accel);
+int linear_source_busy(struct source *s);
+void linear_source_get_position(struct source *s, int32_t *pos);
+
+#endif /* __LINEAR_SOURCE_H__ */
@@ -1,3 +1,4 @@
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,14 +36,45 @@ static void square_wave_source_event(struct source *s, struct event *ev)
 	ss->rising = !ss->rising;
 }
 
+static int square_wave_source_fill(struct source *s, struct timed_event *buf,
+				   int max, int horizon)
+{
+	struct square_wave_source *ss = (struct square_wave_source *)s;
+	int delay = ss->period / 2;
+	int n = 0, t = 0;
+
+	do {
+		buf[n].ev.channel = ss->pin;
+		buf[n].ev.type = ss->rising ? EVENT_RISING_EDGE : EVENT_FALLING_EDGE;
+		buf[n].delay = delay;
+		ss->rising = !ss->rising;
+
+		t += delay;
+		n++;
+	} while (n < max && t < horizon);
+
+	return n;
+}
+
+static volatile sig_atomic_t stop;
+
+static void stop_handler(int sig)
+{
+	stop = 1;
+}
+
 int main(int argc, char *argv[])
 {
 	int ret = 0;
+	unsigned int underruns = 0;
+	unsigned int truncated = 0;
+	struct platform_stats stats;
 
 	struct square_wave_source sq_1kHz = {
 		.base = {
 			.get_delay = square_wave_source_delay,
 			.gen_event = square_wave_source_event,
+			.fill = square_wave_source_fill,
 		},
 		/* 10us tick by default - 100 * 10us = 1ms, 1 kHz */
 		.period = 100,
@@ -53,6 +85,7 @@ int main(int argc, char *argv[])
 		.base = {
 			.get_delay = square_wave_source_delay,
 			.gen_event = square_wave_source_event,
+			.fill = square_wave_source_fill,
 		},
 		/* 10us tick by default - 30 * 10us = 300 us, 3.333 kHz */
 		.period = 30,
@@ -62,13 +95,7 @@ int main(int argc, char *argv[])
 		.rising = true,
 	};
 
-	struct wave_ctx ctx = {
-		.n_sources = 2,
-		.sources = {
-			&sq_1kHz.base,
-			&sq_3_33kHz.base,
-		},
-	};
+	struct wave_ctx ctx = { 0 };
 	uint32_t pins = (1 << 16) | (1 << 19);
 
 	struct platform *p = platform_init(pins);
@@ -79,17 +106,51 @@ int main(int argc, char *argv[])
 
 	ctx.be = platform_get_backend(p);
 
-	while (1) {
+	if (wave_ctx_add_source(&ctx, &sq_1kHz.base) ||
+	    wave_ctx_add_source(&ctx, &sq_3_33kHz.base)) {
+		fprintf(stderr, "Couldn't add sources\n");
+		ret = 1;
+		goto fail;
+	}
+
+	/* Stop cleanly on Ctrl-C, so the platform's stats get dumped */
+	signal(SIGINT, stop_handler);
+	signal(SIGTERM, stop_handler);
+
+	while (!stop) {
 		ret = platform_sync(p, 1000);
 		if (ret) {
 			fprintf(stderr, "Timeout waiting for fence\n");
+			platform_dump(p);
 			goto fail;
 		}
 
+		platform_get_stats(p, &stats);
+		if (stats.underruns != underruns) {
+			fprintf(stderr, "Underrun! (%u total)\n", stats.underruns);
+			underruns = stats.underruns;
+		}
+
+		if (stats.truncated != truncated) {
+			fprintf(stderr, "Dropped edges! (%u waves truncated)\n", stats.truncated);
+			truncated = stats.truncated;
+		}
+
+		if (stats.chunks && stats.chunks % 1000 == 0) {
+			fprintf(stderr, "Per chunk: generate %llu us, stall %llu us, wait %llu us, encode %llu us\n",
+				(unsigned long long)stats.gen_ns / stats.chunks / 1000,
+				(unsigned long long)stats.stall_ns / stats.chunks / 1000,
+				(unsigned long long)stats.wait_ns / stats.chunks / 1000,
+				(unsigned long long)stats.encode_ns / stats.chunks / 1000);
+		}
+
 		wave_gen(&ctx, 1600);
 	}
 
+	platform_dump(p);
+
 fail:
+	wave_ctx_fini(&ctx);
 	platform_fini(p);
 	return ret;
 }
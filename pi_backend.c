@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "pi_backend.h"
 #include "pi_hw/pi_dma.h"
@@ -28,6 +30,41 @@
 #define N_CBS (4096)
 #define DMA_TICK_US 10
 
+/* How long before a fence is due to stop sleeping and start spinning */
+#define WAKE_SPIN_US 50
+
+/* Most times to poll for the DMA to move off a fence before giving up */
+#define TAIL_SPIN_MAX 100000
+
+/* CBs which end_wave() adds after the last slot: the debug marker and fence */
+#define END_CBS 2
+/* Delay CBs held back to keep time with once a segment is full */
+#define FULL_DELAY_CBS 4
+/* Most CBs a slot takes if its delay fits in one CB: a set, a clear, the delay */
+#define SLOT_CBS 3
+/* start_wave()'s CBs, one slot, and everything held back for the end */
+#define MIN_SEG_CBS (2 + SLOT_CBS + FULL_DELAY_CBS + END_CBS)
+
+/* Wave time, in ticks, at the start and end of a CB */
+struct pi_cb_time {
+	uint32_t start;
+	uint32_t end;
+};
+
+enum pi_cb_kind {
+	CB_SET,
+	CB_CLEAR,
+	CB_SET_CLEAR,
+	CB_DELAY,
+	CB_FENCE,
+	CB_N_KINDS,
+};
+
+struct pi_segment {
+	dma_cb_t *cbs;
+	dma_cb_t *fence;
+};
+
 struct pi_backend {
 	struct wave_backend base;
 	struct dma_channel *dma;
@@ -35,134 +72,511 @@ struct pi_backend {
 
 	uint32_t rising;
 	uint32_t falling;
-
-	int wave_idx;
-	dma_cb_t *waves[2];
+	/* Pin levels at the end of the last slot, for EVENT_TOGGLE */
+	uint32_t level;
+	/* Pins which have been toggled, so every edge on them is a step */
+	uint32_t toggled;
+
+	enum pi_encoding encoding;
+	dma_cb_t *last_delay;
+	uint32_t last_delay_ticks;
+	uint32_t last_n_cbs;
+
+	/* Ring of segments, each one starting with its own fence */
+	int n_segments;
+	int seg_cbs;
+	int seg_idx;
+	struct pi_segment *segs;
+	dma_cb_t *cbs;
 	dma_cb_t *tail;
-	dma_cb_t *fence;
+
+	/*
+	 * Segments are built at cursor, either directly in DMA memory or in
+	 * the (cached) staging area, to be copied over in one go.
+	 */
+	dma_cb_t *staging;
+	dma_cb_t *build;
+	int build_idx;
+	uint32_t build_bus;
 	dma_cb_t *cursor;
+	/* Set when the segment ran out of CBs, and edges are being dropped */
+	bool full;
+
+	/* One CB of each kind, with addresses relative to the CB's own */
+	dma_cb_t tmpl[CB_N_KINDS];
+	struct timespec build_start;
+
+	/* Cached copy of the timing of every CB, indexed the same as cbs */
+	struct pi_cb_time *cb_time;
+	uint32_t ticks;
+
+	// Pin state to drive when the DMA runs dry
+	uint32_t safe_set;
+	uint32_t safe_clear;
+	/* The DMA ran dry, and the safe state is applied, but not restarted */
+	bool stalled;
+
+	struct pi_backend_stats stats;
 
 	// Debug
 	dma_cb_t *prev_tail;
 
-	// Not owned by us. (and debug only... FIXME: this is ugly)
+	// Not owned by us. Used for debug and the underrun safe state
 	struct gpio_dev *gpio;
 };
 
+/* The CB in DMA memory which cb, in the build area, will end up as */
+static inline dma_cb_t *pi_backend_cb_real(struct pi_backend *be, dma_cb_t *cb)
+{
+	return be->cbs + be->build_idx + (cb - be->build);
+}
 
-static void pi_backend_add_event(struct wave_backend *wb, struct source *s)
+static inline uint32_t pi_backend_cb_bus(struct pi_backend *be, dma_cb_t *cb)
 {
-	struct pi_backend *be = (struct pi_backend *)wb;
-	struct event ev;
+	return be->build_bus + ((cb - be->build) * sizeof(dma_cb_t));
+}
 
-	s->gen_event(s, &ev);
+/*
+ * Write a CB of the given kind at cb, linked to the CB after it, and record
+ * its timing. The caller fills in the payload.
+ */
+static inline dma_cb_t *pi_backend_emit(struct pi_backend *be, dma_cb_t *cb,
+					enum pi_cb_kind kind, uint32_t ticks)
+{
+	uint32_t bus = pi_backend_cb_bus(be, cb);
+	struct pi_cb_time *t = &be->cb_time[be->build_idx + (cb - be->build)];
+
+	*cb = be->tmpl[kind];
+	cb->src += bus;
+	cb->next = bus + sizeof(dma_cb_t);
+
+	t->start = be->ticks;
+	t->end = be->ticks + ticks;
+	be->ticks += ticks;
+
+	return cb;
+}
+
+static inline void pi_backend_emit_delay(struct pi_backend *be, dma_cb_t *cb, uint32_t ticks)
+{
+	pi_backend_emit(be, cb, CB_DELAY, ticks)->length += (ticks - 1) << 16;
+}
 
-	switch (ev.type) {
+static inline void pi_backend_emit_fence(struct pi_backend *be, dma_cb_t *cb)
+{
+	pi_backend_emit(be, cb, CB_FENCE, 0)->dst += pi_backend_cb_bus(be, cb);
+}
+
+static void pi_backend_emit_event(struct wave_backend *wb, const struct event *ev)
+{
+	struct pi_backend *be = (struct pi_backend *)wb;
+	uint32_t bit;
+
+	switch (ev->type) {
 	case EVENT_RISING_EDGE:
-		be->rising |= (1 << ev.channel);
+		be->rising |= (1 << ev->channel);
 		break;
 	case EVENT_FALLING_EDGE:
-		be->falling |= (1 << ev.channel);
+		be->falling |= (1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		be->rising |= ev->rising;
+		be->falling |= ev->falling;
+		break;
+	case EVENT_TOGGLE:
+		bit = 1 << ev->channel;
+		be->toggled |= bit;
+		if (((be->level | be->rising) & ~be->falling) & bit) {
+			be->rising &= ~bit;
+			be->falling |= bit;
+		} else {
+			be->falling &= ~bit;
+			be->rising |= bit;
+		}
+		break;
+	case EVENT_NONE:
 		break;
 	}
 }
 
-static void pi_backend_add_delay(struct wave_backend *wb, int delay)
+static void pi_backend_add_event(struct wave_backend *wb, struct source *s)
+{
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	pi_backend_emit_event(wb, &ev);
+}
+
+/* Room for n more CBs, still leaving room for the end of the wave */
+static inline bool pi_backend_has_room(struct pi_backend *be, int n)
+{
+	return (be->cursor - be->build) + n <= be->seg_cbs - END_CBS - FULL_DELAY_CBS;
+}
+
+/* Most CBs a slot can take: a set and a clear, plus the delay */
+static inline bool pi_backend_slot_fits(struct pi_backend *be, int delay)
+{
+	return pi_backend_has_room(be, 2 + ((delay + DMA_DELAY_MAX_PACES - 1) / DMA_DELAY_MAX_PACES));
+}
+
+/* Make the last delay CB longer, returning how many ticks it took */
+static uint32_t pi_backend_stretch_delay(struct pi_backend *be, uint32_t delay)
+{
+	uint32_t ticks = DMA_DELAY_MAX_PACES - be->last_delay_ticks;
+
+	if (ticks > delay) {
+		ticks = delay;
+	}
+
+	be->last_delay_ticks += ticks;
+	be->last_delay->length += ticks << 16;
+	be->cb_time[pi_backend_cb_real(be, be->last_delay) - be->cbs].end += ticks;
+	be->ticks += ticks;
+
+	return ticks;
+}
+
+static void pi_backend_add_delay_dense(struct pi_backend *be, int delay)
 {
-	struct pi_backend *be = (struct pi_backend *)wb;
 	dma_cb_t *cb = be->cursor;
+	uint32_t ticks;
 
-	dma_rising_edge(be->dma, be->rising, cb, phys_virt_to_bus(be->phys, cb));
-	cb->next = phys_virt_to_bus(be->phys, cb + 1);
-	cb++;
+	pi_backend_emit(be, cb++, CB_SET, 0)->pad[0] = be->rising;
+	pi_backend_emit(be, cb++, CB_CLEAR, 0)->pad[0] = be->falling;
 
-	dma_falling_edge(be->dma, be->falling, cb, phys_virt_to_bus(be->phys, cb));
-	cb->next = phys_virt_to_bus(be->phys, cb + 1);
-	cb++;
+	while (delay) {
+		ticks = delay > DMA_DELAY_MAX_PACES ? DMA_DELAY_MAX_PACES : delay;
+		pi_backend_emit_delay(be, cb++, ticks);
+		delay -= ticks;
+	}
 
-	dma_delay(be->dma, delay * DMA_TICK_US, cb, phys_virt_to_bus(be->phys, cb));
-	cb->next = phys_virt_to_bus(be->phys, cb + 1);
-	cb++;
+	be->cursor = cb;
+}
+
+static void pi_backend_add_delay_sparse(struct pi_backend *be, int delay)
+{
+	dma_cb_t *cb = be->cursor;
+	uint32_t ticks;
+
+	if (be->encoding == PI_ENCODING_SET_CLEAR && be->rising && be->falling) {
+		pi_backend_emit(be, cb, CB_SET_CLEAR, 0);
+		cb->pad[0] = be->rising;
+		cb->pad[1] = be->falling;
+		cb++;
+		be->last_delay = NULL;
+	} else {
+		if (be->rising) {
+			pi_backend_emit(be, cb++, CB_SET, 0)->pad[0] = be->rising;
+			be->last_delay = NULL;
+		}
+
+		if (be->falling) {
+			pi_backend_emit(be, cb++, CB_CLEAR, 0)->pad[0] = be->falling;
+			be->last_delay = NULL;
+		}
+	}
+
+	// Nothing happened since the last delay, so just make it longer
+	if (be->last_delay) {
+		delay -= pi_backend_stretch_delay(be, delay);
+	}
+
+	while (delay) {
+		ticks = delay > DMA_DELAY_MAX_PACES ? DMA_DELAY_MAX_PACES : delay;
+
+		pi_backend_emit_delay(be, cb, ticks);
+		be->last_delay = cb;
+		be->last_delay_ticks = ticks;
+		cb++;
+
+		delay -= ticks;
+	}
 
 	be->cursor = cb;
+}
+
+/*
+ * The segment is out of CBs, so drop the rest of the wave's edges and only
+ * keep time, using the delay CBs which were held back. If even those run
+ * out, the wave ends early.
+ */
+static void pi_backend_add_delay_full(struct pi_backend *be, int delay)
+{
+	dma_cb_t *cb = be->cursor;
+	dma_cb_t *end = be->build + be->seg_cbs - END_CBS;
+	uint32_t ticks;
+
+	if (!be->full) {
+		be->full = true;
+		be->stats.truncated++;
+	}
+
+	while (delay) {
+		if (be->last_delay && be->last_delay_ticks < DMA_DELAY_MAX_PACES) {
+			ticks = pi_backend_stretch_delay(be, delay);
+		} else if (cb < end) {
+			ticks = delay > DMA_DELAY_MAX_PACES ? DMA_DELAY_MAX_PACES : delay;
+			pi_backend_emit_delay(be, cb, ticks);
+			be->last_delay = cb;
+			be->last_delay_ticks = ticks;
+			cb++;
+		} else {
+			break;
+		}
+
+		delay -= ticks;
+	}
+
+	be->cursor = cb;
+}
+
+static void pi_backend_add_delay(struct wave_backend *wb, int delay)
+{
+	struct pi_backend *be = (struct pi_backend *)wb;
+
+	if (be->full || !pi_backend_slot_fits(be, delay)) {
+		pi_backend_add_delay_full(be, delay);
+		be->rising = be->falling = 0;
+		return;
+	}
+
+	switch (be->encoding) {
+	case PI_ENCODING_DENSE:
+		pi_backend_add_delay_dense(be, delay);
+		break;
+	case PI_ENCODING_SPARSE:
+	case PI_ENCODING_SET_CLEAR:
+		pi_backend_add_delay_sparse(be, delay);
+		break;
+	}
+
+	be->level = (be->level | be->rising) & ~be->falling;
 	be->rising = be->falling = 0;
 }
 
+/* Expand a run straight into CBs, without going back to wave_gen per edge */
+static int pi_backend_add_run(struct wave_backend *wb, struct step_run *run, int limit)
+{
+	struct pi_backend *be = (struct pi_backend *)wb;
+	uint32_t mask = 1 << run->channel;
+	struct event ev = { .type = EVENT_TOGGLE, .channel = run->channel };
+	int ticks = 0;
+
+	while (run->count) {
+		int interval = step_run_interval(run);
+		int delay = step_run_clip(run, ticks, limit);
+
+		/* Leave the step for the next wave rather than drop its edges */
+		if (!delay || !pi_backend_has_room(be, run->pulsewidth ? 2 * SLOT_CBS : SLOT_CBS)) {
+			break;
+		}
+
+		if (!run->pulsewidth) {
+			pi_backend_emit_event(wb, &ev);
+			pi_backend_add_delay(wb, delay);
+		} else {
+			be->rising = mask;
+			pi_backend_add_delay(wb, run->pulsewidth);
+			be->falling = mask;
+			pi_backend_add_delay(wb, delay - run->pulsewidth);
+		}
+
+		ticks += interval;
+		step_run_advance(run);
+	}
+
+	return ticks;
+}
+
+/*
+ * Stop wave_gen() before a slot could run out of CBs, so the rest of its
+ * budget goes into the next segment instead of being dropped
+ */
+static bool pi_backend_full(struct wave_backend *wb)
+{
+	struct pi_backend *be = (struct pi_backend *)wb;
+
+	return be->full || !pi_backend_has_room(be, SLOT_CBS);
+}
+
 static void pi_backend_start_wave(struct wave_backend *wb)
 {
 	struct pi_backend *be = (struct pi_backend *)wb;
 
 	gpio_debug_set(be->gpio, 1 << DBG_CPUTIME_PIN);
 
-	be->cursor = be->waves[be->wave_idx];
+	clock_gettime(CLOCK_MONOTONIC, &be->build_start);
+
+	be->build = be->staging ? be->staging : be->segs[be->seg_idx].cbs;
+	be->build_idx = be->segs[be->seg_idx].cbs - be->cbs;
+	be->build_bus = phys_virt_to_bus(be->phys, be->segs[be->seg_idx].cbs);
+	be->cursor = be->build;
+	be->last_delay = NULL;
+	be->full = false;
 
 	// Insert a fence
-	dma_fence(be->dma, 1, be->cursor, phys_virt_to_bus(be->phys, be->cursor));
-	be->fence = be->cursor;
-	be->cursor->next = phys_virt_to_bus(be->phys, be->cursor + 1);
-	be->cursor++;
+	be->segs[be->seg_idx].fence = pi_backend_cb_real(be, be->cursor);
+	pi_backend_emit_fence(be, be->cursor++);
 
 #ifdef DEBUG
 	/* Mark chunks for debugging */
-	if (be->wave_idx) {
-		dma_rising_edge(be->dma, (1 << DBG_CHUNK_PIN), be->cursor, phys_virt_to_bus(be->phys, be->cursor));
-	} else {
-		dma_falling_edge(be->dma, (1 << DBG_CHUNK_PIN), be->cursor, phys_virt_to_bus(be->phys, be->cursor));
-	}
-	be->cursor->next = phys_virt_to_bus(be->phys, be->cursor + 1);
-	be->cursor++;
+	pi_backend_emit(be, be->cursor++, (be->seg_idx & 1) ? CB_SET : CB_CLEAR, 0)->pad[0] =
+		(1 << DBG_CHUNK_PIN);
 #endif
 }
 
+/*
+ * If the DMA has stopped at the end of the chain then nothing is driving
+ * the outputs, so count the underrun and put them into their safe state
+ * straight away, rather than when the next segment gets linked on.
+ * Returns true if the DMA is stopped.
+ */
+static bool pi_backend_check_stall(struct pi_backend *be)
+{
+	/*
+	 * Forcing a toggled (dual-edge) pin would be a step of its own, so
+	 * those are left where they are
+	 */
+	uint32_t set = be->safe_set & ~be->toggled;
+	uint32_t clear = be->safe_clear & ~be->toggled;
+
+	if (be->stalled) {
+		return true;
+	}
+
+	if (dma_channel_active(be->dma)) {
+		return false;
+	}
+
+	be->stalled = true;
+	be->stats.underruns++;
+
+	gpio_set(be->gpio, set);
+	gpio_clear(be->gpio, clear);
+	be->level = (be->level | set) & ~clear;
+
+	return true;
+}
+
+/*
+ * Must be called after linking a new segment onto prev_tail. If the DMA
+ * already stopped at the end of the old chain, then restart the channel
+ * directly on the new segment.
+ */
+static void pi_backend_check_underrun(struct pi_backend *be, dma_cb_t *prev_tail,
+				      uint32_t seg_addr)
+{
+	uint32_t tail_addr = phys_virt_to_bus(be->phys, prev_tail);
+	int spins = 0;
+
+	/*
+	 * If the terminal fence was loaded before its ->next was updated, then
+	 * the DMA is going to stop after it. It's only a single word write, so
+	 * wait for the outcome. If the DMA still hasn't moved on, leave it: it's
+	 * still active, so it will follow the new link.
+	 */
+	while (dma_channel_active(be->dma) && dma_channel_get_cb(be->dma) == tail_addr) {
+		if (++spins == TAIL_SPIN_MAX) {
+			return;
+		}
+	}
+
+	if (!pi_backend_check_stall(be)) {
+		return;
+	}
+
+	be->stalled = false;
+	dma_channel_resume(be->dma, seg_addr);
+}
+
 static void pi_backend_end_wave(struct wave_backend *wb)
 {
 	struct pi_backend *be = (struct pi_backend *)wb;
+	dma_cb_t *prev_tail = be->tail;
+	uint32_t seg_addr = be->build_bus;
+	struct timespec now;
 	uint32_t n_cbs;
 
 #ifdef DEBUG
 	/* Mark chunks for debugging */
-	if (be->wave_idx) {
-		dma_falling_edge(be->dma, (1 << DBG_CHUNK_PIN), be->cursor, phys_virt_to_bus(be->phys, be->cursor));
-	} else {
-		dma_rising_edge(be->dma, (1 << DBG_CHUNK_PIN), be->cursor, phys_virt_to_bus(be->phys, be->cursor));
-	}
-	be->cursor->next = phys_virt_to_bus(be->phys, be->cursor + 1);
-	be->cursor++;
+	pi_backend_emit(be, be->cursor++, (be->seg_idx & 1) ? CB_CLEAR : CB_SET, 0)->pad[0] =
+		(1 << DBG_CHUNK_PIN);
 #endif
 
 	// Insert a dummy transaction - if the last "real" element is a long
 	// delay, then it could get loaded (and so the "->next" pointer frozen)
 	// before we set up the next segment.
-	dma_fence(be->dma, 1, be->cursor, phys_virt_to_bus(be->phys, be->cursor));
-	be->cursor->next = (uint32_t)NULL;
+	pi_backend_emit_fence(be, be->cursor);
+	be->cursor->next = 0;
+
+	n_cbs = be->cursor + 1 - be->build;
+	be->last_n_cbs = n_cbs;
+
+	if (be->staging) {
+		/*
+		 * Copy the whole segment across in one go, and make sure it has
+		 * all landed before linking it in. add_delay() keeps n_cbs
+		 * within seg_cbs, which is the size of the staging area.
+		 */
+		memcpy(be->segs[be->seg_idx].cbs, be->staging, n_cbs * sizeof(dma_cb_t));
+		__sync_synchronize();
+	}
 
-	be->tail->next = phys_virt_to_bus(be->phys, be->waves[be->wave_idx]);
-	be->tail = be->cursor;
+	be->tail->next = seg_addr;
+	be->tail = pi_backend_cb_real(be, be->cursor);
+	pi_backend_check_underrun(be, prev_tail, seg_addr);
 
-	n_cbs = be->cursor - be->waves[be->wave_idx];
-	if (n_cbs > (N_CBS / 4)) {
-		fprintf(stderr, "Used %d (of %d) CBs for this wave\n", n_cbs, N_CBS / 2);
+	if (be->full) {
+		fprintf(stderr, "Ran out of CBs, dropped edges from this wave\n");
+	} else if (n_cbs > (be->seg_cbs / 2)) {
+		fprintf(stderr, "Used %d (of %d) CBs for this wave\n", n_cbs, be->seg_cbs);
 	}
 	be->cursor = NULL;
-	be->wave_idx = !be->wave_idx;
+	be->seg_idx = (be->seg_idx + 1) % be->n_segments;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	be->stats.build_ns += ((now.tv_sec - be->build_start.tv_sec) * 1000000000LL) +
+			      (now.tv_nsec - be->build_start.tv_nsec);
+	be->stats.build_cbs += n_cbs;
+	be->stats.builds++;
 
 	gpio_debug_clear(be->gpio, 1 << DBG_CPUTIME_PIN);
 }
 
-struct pi_backend *pi_backend_create(struct board_cfg *board, struct gpio_dev *gpio)
+struct pi_backend *pi_backend_create(struct board_cfg *board, struct gpio_dev *gpio,
+				     int n_segments)
 {
-	uint32_t cb_dma_addr;
-	struct pi_backend *be = calloc(1, sizeof(*be));
+	dma_cb_t *cbs;
+	int i;
+	struct pi_backend *be;
+
+	if (n_segments < 2 || n_segments > N_CBS / MIN_SEG_CBS) {
+		return NULL;
+	}
+
+	be = calloc(1, sizeof(*be));
 	if (!be) {
 		return NULL;
 	}
 
+	be->n_segments = n_segments;
+	be->seg_cbs = N_CBS / n_segments;
+	be->segs = calloc(n_segments, sizeof(*be->segs));
+	be->cb_time = calloc(N_CBS, sizeof(*be->cb_time));
+	if (!be->segs || !be->cb_time) {
+		goto fail;
+	}
+
 	be->base.start_wave = pi_backend_start_wave;
 	be->base.add_delay = pi_backend_add_delay;
 	be->base.add_event = pi_backend_add_event;
+	be->base.emit_event = pi_backend_emit_event;
+	be->base.add_run = pi_backend_add_run;
+	be->base.full = pi_backend_full;
 	be->base.end_wave = pi_backend_end_wave;
 
 	be->gpio = gpio;
+	be->encoding = PI_ENCODING_SET_CLEAR;
 
 	be->phys = phys_alloc(board, sizeof(dma_cb_t) * N_CBS);
 	if (!be->phys) {
@@ -177,26 +591,46 @@ struct pi_backend *pi_backend_create(struct board_cfg *board, struct gpio_dev *g
 	}
 	dma_channel_setup_pacer(be->dma, PACER_PWM, DMA_TICK_US);
 
-	be->waves[0] = (dma_cb_t *)be->phys->virt_addr;
-	be->waves[1] = &be->waves[0][N_CBS / 2];
+	/* Template addresses are built relative to 0, the CB's own address */
+	dma_rising_edge(be->dma, 0, &be->tmpl[CB_SET], 0);
+	dma_falling_edge(be->dma, 0, &be->tmpl[CB_CLEAR], 0);
+	dma_set_clear(be->dma, 0, 0, &be->tmpl[CB_SET_CLEAR], 0);
+	dma_fence(be->dma, 1, &be->tmpl[CB_FENCE], 0);
+	if (dma_delay(be->dma, DMA_TICK_US, &be->tmpl[CB_DELAY], 0)) {
+		fprintf(stderr, "Couldn't set up delay template\n");
+		goto fail;
+	}
+
+	cbs = (dma_cb_t *)be->phys->virt_addr;
+	be->cbs = cbs;
+	for (i = 0; i < n_segments; i++) {
+		be->segs[i].cbs = &cbs[i * be->seg_cbs];
+	}
 
 	/*
-	 * Start the DMA off looping in wave 1. Fence included only for
-	 * consistency
+	 * Start the DMA off looping in segment 0. The first fence is what the
+	 * first pi_backend_wait_fence() which needs to reuse segment 0 will
+	 * wait on. The loop ends in a fence like every other segment, so the
+	 * first end_wave() can link onto it the same way.
 	 */
-	cb_dma_addr = phys_virt_to_bus(be->phys, &be->waves[be->wave_idx][0]);
-	dma_fence(be->dma, 1, &be->waves[be->wave_idx][0], cb_dma_addr);
-	be->fence = &be->waves[be->wave_idx][0];
-	be->waves[be->wave_idx][0].next = cb_dma_addr + sizeof(dma_cb_t);
-
-	dma_delay(be->dma, 8000, be->waves[be->wave_idx] + 1, cb_dma_addr + sizeof(dma_cb_t));
-	be->waves[be->wave_idx][1].next = cb_dma_addr;
+	be->build = cbs;
+	be->build_idx = 0;
+	be->build_bus = phys_virt_to_bus(be->phys, cbs);
+	be->segs[0].fence = &cbs[0];
+	pi_backend_emit_fence(be, &cbs[0]);
+	pi_backend_emit_delay(be, &cbs[1], 8000 / DMA_TICK_US);
+	pi_backend_emit_fence(be, &cbs[2]);
+	cbs[2].next = be->build_bus;
 	be->prev_tail = be->tail;
-	be->tail = &be->waves[be->wave_idx][1];
+	be->tail = &cbs[2];
 
-	be->wave_idx = !be->wave_idx;
+	be->seg_idx = 1;
 
-	dma_channel_run(be->dma, cb_dma_addr);
+	if (pi_backend_set_staging(be, true)) {
+		goto fail;
+	}
+
+	dma_channel_run(be->dma, be->build_bus);
 
 	return be;
 
@@ -205,6 +639,46 @@ fail:
 	return NULL;
 }
 
+void pi_backend_set_encoding(struct pi_backend *be, enum pi_encoding encoding)
+{
+	be->encoding = encoding;
+}
+
+int pi_backend_set_staging(struct pi_backend *be, bool enable)
+{
+	/* A wave is being built in the current staging area (or not) */
+	if (be->cursor) {
+		return -1;
+	}
+
+	if (!enable) {
+		free(be->staging);
+		be->staging = NULL;
+		return 0;
+	}
+
+	if (!be->staging) {
+		if (posix_memalign((void **)&be->staging, sizeof(dma_cb_t),
+				   be->seg_cbs * sizeof(dma_cb_t))) {
+			be->staging = NULL;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void pi_backend_set_safe_state(struct pi_backend *be, uint32_t set, uint32_t clear)
+{
+	be->safe_set = set;
+	be->safe_clear = clear;
+}
+
+void pi_backend_get_stats(struct pi_backend *be, struct pi_backend_stats *stats)
+{
+	*stats = be->stats;
+}
+
 void pi_backend_destroy(struct pi_backend *be)
 {
 	if (be->dma) {
@@ -213,37 +687,191 @@ void pi_backend_destroy(struct pi_backend *be)
 	if (be->phys) {
 		phys_free(be->phys);
 	}
+	free(be->staging);
+	free(be->cb_time);
+	free(be->segs);
 	free(be);
 }
 
 int pi_backend_wait_fence(struct pi_backend *be, int timeout_millis,
 			  int sleep_millis)
 {
-	return dma_fence_wait(be->fence, timeout_millis, sleep_millis);
+	/*
+	 * The next segment to be built can only be reused once the DMA has
+	 * moved on to the segment after it - which is the oldest one still
+	 * queued. Segments which have never been used are free already.
+	 */
+	dma_cb_t *fence = be->segs[(be->seg_idx + 1) % be->n_segments].fence;
+	int ret = 0;
+
+	if (fence) {
+		ret = dma_fence_wait(fence, timeout_millis, sleep_millis);
+	}
+
+	pi_backend_check_stall(be);
+
+	return ret;
+}
+
+/*
+ * Work out how many ticks it will be until the DMA reaches fence, from the
+ * CB it's currently executing. Returns -1 if the DMA isn't in our CBs.
+ */
+static int pi_backend_ticks_to_fence(struct pi_backend *be, dma_cb_t *fence)
+{
+	uint32_t base = phys_virt_to_bus(be->phys, be->cbs);
+	uint32_t addr = dma_channel_get_cb(be->dma);
+	struct pi_cb_time *t;
+	uint32_t pos, rows;
+
+	if (addr < base || addr >= base + (N_CBS * sizeof(dma_cb_t))) {
+		return -1;
+	}
+
+	t = &be->cb_time[(addr - base) / sizeof(dma_cb_t)];
+	pos = t->start;
+	if (t->end != t->start) {
+		/* Part-way through a delay */
+		rows = dma_channel_get_rows_left(be->dma);
+		if (rows <= t->end - t->start) {
+			pos = t->end - rows;
+		}
+	}
+
+	return (int32_t)(be->cb_time[fence - be->cbs].start - pos);
+}
+
+static void timespec_add_us(struct timespec *ts, long us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	} else if (ts->tv_nsec < 0) {
+		ts->tv_sec--;
+		ts->tv_nsec += 1000000000;
+	}
+}
+
+static long timespec_diff_us(struct timespec *a, struct timespec *b)
+{
+	return ((a->tv_sec - b->tv_sec) * 1000000) + ((a->tv_nsec - b->tv_nsec) / 1000);
+}
+
+static void pi_backend_record_wake(struct pi_backend *be, long latency)
+{
+	if (latency < 0) {
+		latency = 0;
+	}
+	latency /= PI_WAKE_HIST_BUCKET_US;
+	if (latency >= PI_WAKE_HIST_BUCKETS) {
+		latency = PI_WAKE_HIST_BUCKETS - 1;
+	}
+	be->stats.wake_hist[latency]++;
+}
+
+int pi_backend_wait_fence_precise(struct pi_backend *be, int timeout_millis)
+{
+	dma_cb_t *fence = be->segs[(be->seg_idx + 1) % be->n_segments].fence;
+	struct timespec now, wake, timeout, due;
+	bool timed, waited = false;
+	int ticks;
+
+	if (!fence) {
+		pi_backend_check_stall(be);
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timeout = now;
+	timespec_add_us(&timeout, timeout_millis * 1000L);
+
+	/* When the fence should signal, going by the CB timings */
+	due = now;
+	ticks = pi_backend_ticks_to_fence(be, fence);
+	timed = ticks >= 0;
+	if (timed) {
+		timespec_add_us(&due, ticks * DMA_TICK_US);
+	}
+
+	while (!dma_fence_signaled(fence)) {
+		waited = true;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timeout_millis >= 0 && timespec_diff_us(&now, &timeout) >= 0) {
+			pi_backend_check_stall(be);
+			return -1;
+		}
+
+		ticks = pi_backend_ticks_to_fence(be, fence);
+		if (ticks < 0) {
+			/* No idea where the DMA is, so just poll */
+			wake = now;
+			timespec_add_us(&wake, 1000);
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+			continue;
+		}
+
+		if (ticks * DMA_TICK_US > WAKE_SPIN_US) {
+			wake = now;
+			timespec_add_us(&wake, (ticks * DMA_TICK_US) - WAKE_SPIN_US);
+			if (timeout_millis >= 0 && timespec_diff_us(&wake, &timeout) > 0) {
+				wake = timeout;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+		}
+	}
+
+	if (timed && waited) {
+		/* How long after the fence was due we noticed it */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pi_backend_record_wake(be, timespec_diff_us(&now, &due));
+	}
+
+	pi_backend_check_stall(be);
+
+	return 0;
 }
 
 void pi_backend_dump(struct pi_backend *be)
 {
-	fprintf(stderr, "waves[0]: %p\n", be->waves[0]);
-	dma_cb_dump(be->waves[0]);
-	fprintf(stderr, "---\n");
+	int i;
 
-	fprintf(stderr, "waves[1]: %p\n", be->waves[1]);
-	dma_cb_dump(be->waves[1]);
-	fprintf(stderr, "---\n");
+	for (i = 0; i < be->n_segments; i++) {
+		fprintf(stderr, "segs[%d]: %p\n", i, be->segs[i].cbs);
+		dma_cb_dump(be->segs[i].cbs);
+		fprintf(stderr, "---\n");
+	}
 
 	fprintf(stderr, "Prev Tail:\n");
 	dma_cb_dump(be->prev_tail);
 	fprintf(stderr, "---\n");
 
-	fprintf(stderr, "Fence:\n");
-	dma_cb_dump(be->fence);
+	fprintf(stderr, "Oldest fence:\n");
+	dma_cb_dump(be->segs[(be->seg_idx + 1) % be->n_segments].fence);
 	fprintf(stderr, "---\n");
 
 	fprintf(stderr, "Tail:\n");
 	dma_cb_dump(be->tail);
 	fprintf(stderr, "---\n");
 
+	fprintf(stderr, "CBs in last wave: %d\n", be->last_n_cbs);
+	if (be->stats.builds) {
+		fprintf(stderr, "Build time: %lld ns per wave, %lld ns per CB (%s)\n",
+			(long long)(be->stats.build_ns / be->stats.builds),
+			(long long)(be->stats.build_ns / be->stats.build_cbs),
+			be->staging ? "staged" : "direct");
+	}
+	fprintf(stderr, "Underruns: %u\n", be->stats.underruns);
+	fprintf(stderr, "Truncated waves: %u\n", be->stats.truncated);
+	fprintf(stderr, "Fence to wake latency:\n");
+	for (i = 0; i < PI_WAKE_HIST_BUCKETS - 1; i++) {
+		fprintf(stderr, "  < %4d us: %u\n", (i + 1) * PI_WAKE_HIST_BUCKET_US,
+			be->stats.wake_hist[i]);
+	}
+	fprintf(stderr, "  >=%4d us: %u\n", i * PI_WAKE_HIST_BUCKET_US, be->stats.wake_hist[i]);
+	fprintf(stderr, "---\n");
+
 	fprintf(stderr, "Dma chan\n");
 	dma_channel_dump(be->dma);
 	fprintf(stderr, "---\n");
@@ -16,16 +16,74 @@
  */
 #ifndef __PI_BACKEND_H__
 #define __PI_BACKEND_H__
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "pi_hw/pi_util.h"
 #include "pi_hw/pi_gpio.h"
 
 struct pi_backend;
 
-struct pi_backend *pi_backend_create(struct board_cfg *board, struct gpio_dev *gpio);
+#define PI_WAKE_HIST_BUCKETS	16
+#define PI_WAKE_HIST_BUCKET_US	10
+
+struct pi_backend_stats {
+	unsigned int underruns;
+	/* Waves which didn't fit in a segment, and had edges dropped */
+	unsigned int truncated;
+
+	/* Total time spent between start_wave and end_wave, and CBs written */
+	uint64_t build_ns;
+	uint64_t build_cbs;
+	unsigned int builds;
+
+	/*
+	 * How long after a fence was due to signal, going by where the DMA
+	 * was when the wait started, the waiter saw that it had
+	 */
+	unsigned int wake_hist[PI_WAKE_HIST_BUCKETS];
+};
+
+enum pi_encoding {
+	/* Set, clear and delay CBs for every slot */
+	PI_ENCODING_DENSE,
+	/* Only emit set/clear CBs which change pins, merge adjacent delays */
+	PI_ENCODING_SPARSE,
+	/* As sparse, but use a single 2D CB when a slot both sets and clears */
+	PI_ENCODING_SET_CLEAR,
+};
+
+/*
+ * The CB memory is split into a ring of n_segments segments, one per call
+ * to wave_gen(). pi_backend_wait_fence() waits for a segment to be free, so
+ * up to n_segments - 1 segments can be queued ahead of the DMA.
+ */
+struct pi_backend *pi_backend_create(struct board_cfg *board, struct gpio_dev *gpio,
+				     int n_segments);
 void pi_backend_destroy(struct pi_backend *be);
 
+void pi_backend_set_encoding(struct pi_backend *be, enum pi_encoding encoding);
+/*
+ * When enabled (the default), segments are built in normal cached memory
+ * and copied to the uncached DMA memory in one go, instead of writing each
+ * CB field straight to DMA memory. Can't be changed between start_wave and
+ * end_wave.
+ */
+int pi_backend_set_staging(struct pi_backend *be, bool enable);
+/*
+ * Pins to set and clear when the DMA runs dry. Pins which have had
+ * EVENT_TOGGLE events are left alone, as any edge on them is a step.
+ */
+void pi_backend_set_safe_state(struct pi_backend *be, uint32_t set, uint32_t clear);
+void pi_backend_get_stats(struct pi_backend *be, struct pi_backend_stats *stats);
+
 int pi_backend_wait_fence(struct pi_backend *be, int timeout_millis,
 			  int sleep_millis);
+/*
+ * As pi_backend_wait_fence(), but use the DMA's position in the CB chain to
+ * sleep until just before the fence is due, and then spin
+ */
+int pi_backend_wait_fence_precise(struct pi_backend *be, int timeout_millis);
 void pi_backend_dump(struct pi_backend *be);
 
 #endif /* __PI_BACKEND_H__ */
@@ -78,6 +78,8 @@ int clock_set_rate(struct clock_dev *dev, enum clock_consumer c, uint64_t rate)
 	case CLOCK_CONSUMER_PCM:
 		base = 38;
 		break;
+	default:
+		return -1;
 	}
 
 	divisor = 500000000.0 / rate;
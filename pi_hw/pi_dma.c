@@ -34,6 +34,7 @@
 #define DMA_CHAN_MIN		0
 #define DMA_CHAN_MAX		14
 
+#define DMA_ACTIVE		(1<<0)
 #define DMA_NO_WIDE_BURSTS	(1<<26)
 #define DMA_WAIT_RESP		(1<<3)
 #define DMA_D_DREQ		(1<<6)
@@ -43,10 +44,13 @@
 #define DMA_INT			(1<<2)
 #define DMA_SRC_IGNORE		(1<<11)
 #define DMA_TDMODE		(1<<1)
+#define DMA_DEST_INC		(1<<4)
+#define DMA_SRC_INC		(1<<8)
 
 #define DMA_CS			(0x00/4)
 #define DMA_CONBLK_AD		(0x04/4)
 #define DMA_SOURCE_AD		(0x0c/4)
+#define DMA_TXFR_LEN		(0x14/4)
 #define DMA_DEBUG		(0x20/4)
 
 #define PWM_BASE_OFFSET		0x0020C000
@@ -217,19 +221,42 @@ void dma_channel_run(struct dma_channel *ch, uint32_t cb_dma_addr)
 {
 	// Initialise the DMA
 	ch->reg[DMA_CS] = DMA_RESET;
-	/* TODO: If this sleep is really needed, then we need a "fast" warm
-	 * path which doesn't do the reset (in case of underruns)
-	 * Or is underrun so catastrophic that we don't care?
+	/*
+	 * The reset needs some time to take effect. dma_channel_resume() is
+	 * the fast path for restarting a channel which has already been set
+	 * up, after an underrun
 	 */
 	usleep(10);
+	dma_channel_resume(ch, cb_dma_addr);
+
+	if (ch->pacer == PACER_PCM) {
+		pcm_reg[PCM_CS_A] |= 1<<2;			// Enable Tx
+	}
+}
+
+/* Restart a channel which has run off the end of its CB chain */
+void dma_channel_resume(struct dma_channel *ch, uint32_t cb_dma_addr)
+{
 	ch->reg[DMA_CS] = DMA_INT | DMA_END;
 	ch->reg[DMA_CONBLK_AD] = cb_dma_addr;
 	ch->reg[DMA_DEBUG] = 7; // clear debug error flags
 	ch->reg[DMA_CS] = 0x10880001;	// go, mid priority, wait for outstanding writes
+}
 
-	if (ch->pacer == PACER_PCM) {
-		pcm_reg[PCM_CS_A] |= 1<<2;			// Enable Tx
-	}
+bool dma_channel_active(struct dma_channel *ch)
+{
+	return ch->reg[DMA_CS] & DMA_ACTIVE;
+}
+
+uint32_t dma_channel_get_cb(struct dma_channel *ch)
+{
+	return ch->reg[DMA_CONBLK_AD];
+}
+
+/* Number of rows left in the current CB, which for a delay is pacer ticks */
+uint32_t dma_channel_get_rows_left(struct dma_channel *ch)
+{
+	return ((ch->reg[DMA_TXFR_LEN] >> 16) & 0x3fff) + 1;
 }
 
 /* TODO: Do we need access to pins 32-53 ? */
@@ -240,7 +267,7 @@ void dma_rising_edge(struct dma_channel *ch, uint32_t pins, dma_cb_t *cb, uint32
 	cb->dst = ch->periph_phys_base + GPIO_BASE_OFFSET + 0x1c;
 	cb->length = 4;
 	cb->stride = 0;
-	cb->next = (uint32_t)NULL;
+	cb->next = 0;
 	cb->pad[0] = pins;
 }
 
@@ -251,10 +278,27 @@ void dma_falling_edge(struct dma_channel *ch, uint32_t pins, dma_cb_t *cb, uint3
 	cb->dst = ch->periph_phys_base + GPIO_BASE_OFFSET + 0x28;
 	cb->length = 4;
 	cb->stride = 0;
-	cb->next = (uint32_t)NULL;
+	cb->next = 0;
 	cb->pad[0] = pins;
 }
 
+/*
+ * Write both GPSET0 and GPCLR0 from a single CB, using a 2D transfer of two
+ * 1-word rows. The source walks pad[0] then pad[1], and the destination
+ * stride skips from GPSET0 (0x1c) over to GPCLR0 (0x28)
+ */
+void dma_set_clear(struct dma_channel *ch, uint32_t set, uint32_t clear, dma_cb_t *cb, uint32_t cb_dma_addr)
+{
+	cb->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_TDMODE | DMA_SRC_INC | DMA_DEST_INC;
+	cb->src = cb_dma_addr + offsetof(dma_cb_t, pad);
+	cb->dst = ch->periph_phys_base + GPIO_BASE_OFFSET + 0x1c;
+	cb->length = (1 << 16) | 4;
+	cb->stride = (8 << 16) | 0;
+	cb->next = 0;
+	cb->pad[0] = set;
+	cb->pad[1] = clear;
+}
+
 int dma_delay(struct dma_channel *ch, uint32_t delay_us, dma_cb_t *cb, uint32_t cb_dma_addr)
 {
 	uint32_t phys_fifo_addr;
@@ -266,12 +310,18 @@ int dma_delay(struct dma_channel *ch, uint32_t delay_us, dma_cb_t *cb, uint32_t
 		return -1;
 	}
 
+	if (!delay_us || (delay_us / ch->pace_us) > DMA_DELAY_MAX_PACES) {
+		return -1;
+	}
+
 	if (ch->pacer == PACER_PWM) {
 		phys_fifo_addr = (ch->periph_phys_base + PWM_BASE_OFFSET) + 0x18;
 		cb->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_D_DREQ | DMA_PER_MAP(5) | DMA_SRC_IGNORE | DMA_TDMODE;
 	} else if (ch->pacer == PACER_PCM) {
 		phys_fifo_addr = (ch->periph_phys_base + PCM_BASE_OFFSET) + 0x04;
 		cb->info = DMA_NO_WIDE_BURSTS | DMA_WAIT_RESP | DMA_D_DREQ | DMA_PER_MAP(2) | DMA_SRC_IGNORE | DMA_TDMODE;
+	} else {
+		return -1;
 	}
 
 	delay_us /= ch->pace_us;
@@ -280,7 +330,7 @@ int dma_delay(struct dma_channel *ch, uint32_t delay_us, dma_cb_t *cb, uint32_t
 	cb->dst = phys_fifo_addr;
 	cb->length = ((delay_us - 1) << 16) | 4;
 	cb->stride = 0;
-	cb->next = (uint32_t)NULL;
+	cb->next = 0;
 
 	return 0;
 }
@@ -292,7 +342,7 @@ void dma_fence(struct dma_channel *ch, uint32_t val, dma_cb_t *cb, uint32_t cb_d
 	cb->dst = cb_dma_addr + offsetof(dma_cb_t, pad) + 4;
 	cb->length = 4;
 	cb->stride = 0;
-	cb->next = (uint32_t)NULL;
+	cb->next = 0;
 	cb->pad[0] = val;
 	cb->pad[1] = 0;
 }
@@ -347,7 +397,7 @@ void dma_cb_dump(dma_cb_t *cb)
 		return;
 	}
 
-	printf("VA : %08x\n", (uint32_t)cb);
+	printf("VA : %p\n", cb);
 	printf("TI : %08x\n", cb->info);
 	printf("SAD: %08x\n", cb->src);
 	printf("DAD: %08x\n", cb->dst);
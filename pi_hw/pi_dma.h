@@ -29,6 +29,9 @@
 
 struct dma_channel;
 
+/* The longest delay which fits in a single CB (YLENGTH is 14 bits) */
+#define DMA_DELAY_MAX_PACES	(1 << 14)
+
 typedef struct {
 	uint32_t info;
 	uint32_t src;
@@ -51,9 +54,14 @@ void dma_channel_fini(struct dma_channel *ch);
 void dma_channel_setup_pacer(struct dma_channel *ch, enum dma_pacer pacer,
 			     uint32_t pace_us);
 void dma_channel_run(struct dma_channel *ch, uint32_t cb_dma_addr);
+void dma_channel_resume(struct dma_channel *ch, uint32_t cb_dma_addr);
+bool dma_channel_active(struct dma_channel *ch);
+uint32_t dma_channel_get_cb(struct dma_channel *ch);
+uint32_t dma_channel_get_rows_left(struct dma_channel *ch);
 
 void dma_rising_edge(struct dma_channel *ch, uint32_t pins, dma_cb_t *cb, uint32_t cb_dma_addr);
 void dma_falling_edge(struct dma_channel *ch, uint32_t pins, dma_cb_t *cb, uint32_t cb_dma_addr);
+void dma_set_clear(struct dma_channel *ch, uint32_t set, uint32_t clear, dma_cb_t *cb, uint32_t cb_dma_addr);
 int dma_delay(struct dma_channel *ch, uint32_t delay_us, dma_cb_t *cb, uint32_t cb_dma_addr);
 void dma_fence(struct dma_channel *ch, uint32_t val, dma_cb_t *cb, uint32_t cb_dma_addr);
 int dma_fence_wait(dma_cb_t *cb, int timeout_millis, int sleep_millis);
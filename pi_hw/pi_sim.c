@@ -0,0 +1,572 @@
+/*
+ * pi_sim.c Userspace simulation of the BCM283x DMA, PWM and GPIO
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pi_sim.h"
+#include "pi_util.h"
+
+#define SIM_PERIPH_VIRT		0x20000000
+#define SIM_PERIPH_PHYS		0x7e000000
+#define SIM_PERIPH_LEN		0x00300000
+/* Hand out "physical" memory from here, in the uncached bus alias */
+#define SIM_DRAM_BUS		0xC0100000
+
+#define GPIO_BASE_OFFSET	0x00200000
+#define GPIO_SET0		0x1c
+#define GPIO_CLR0		0x28
+#define GPIO_LEV0		0x34
+
+#define PWM_BASE_OFFSET		0x0020C000
+#define PWM_RNG1		0x10
+#define PCM_BASE_OFFSET		0x00203000
+#define PCM_MODE_A		0x08
+
+#define DMA_BASE_OFFSET		0x00007000
+#define DMA_CHAN_SIZE		0x100
+#define DMA_N_CHANS		15
+
+#define DMA_CS			0
+#define DMA_CONBLK_AD		1
+#define DMA_TI			2
+#define DMA_SOURCE_AD		3
+#define DMA_DEST_AD		4
+#define DMA_TXFR_LEN		5
+#define DMA_STRIDE		6
+#define DMA_NEXTCONBK		7
+#define DMA_DEBUG		8
+
+#define DMA_ACTIVE		(1<<0)
+#define DMA_END			(1<<1)
+#define DMA_RESET		(1<<31)
+#define DMA_TDMODE		(1<<1)
+#define DMA_DEST_INC		(1<<4)
+#define DMA_D_DREQ		(1<<6)
+#define DMA_SRC_INC		(1<<8)
+#define DMA_SRC_IGNORE		(1<<11)
+#define DMA_PERMAP(ti)		(((ti) >> 16) & 0x1f)
+#define DMA_DEBUG_READ_ERROR	(1<<2)
+
+#define PERMAP_PCM_TX		2
+#define PERMAP_PWM		5
+
+#define PACER_FIFO_DEPTH	16
+
+/* Let virtual time run this far ahead of real time before sleeping */
+#define SIM_SLACK_US		100
+/* Count it as lost time if the simulator falls this far behind */
+#define SIM_LATE_US		2000
+#define SIM_IDLE_US		50
+
+struct sim_region {
+	uint32_t bus_addr;
+	uint32_t size;
+	uint8_t *virt;
+	struct sim_region *next;
+};
+
+struct sim_chan {
+	bool running;
+	uint32_t cb_addr;
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_mutex_t lock;
+	pthread_t thread;
+
+	int periph_fd;
+	uint8_t *periph;
+
+	struct sim_region *regions;
+	struct sim_region *last_region;
+	uint32_t next_bus;
+
+	struct sim_chan chans[DMA_N_CHANS];
+
+	struct timespec epoch;
+	uint64_t now_us;
+	/* Virtual time at which the pacer FIFO will have drained */
+	uint64_t fifo_empty_us;
+
+	struct pi_sim_stats stats;
+	FILE *trace;
+	bool print_stats;
+} sim = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.next_bus = SIM_DRAM_BUS,
+};
+
+static uint64_t sim_real_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((ts.tv_sec - sim.epoch.tv_sec) * 1000000LL) +
+	       ((ts.tv_nsec - sim.epoch.tv_nsec) / 1000);
+}
+
+static void sim_sleep_until(uint64_t us)
+{
+	struct timespec ts = sim.epoch;
+
+	ts.tv_sec += us / 1000000;
+	ts.tv_nsec += (us % 1000000) * 1000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static volatile uint32_t *sim_periph_reg(uint32_t offset)
+{
+	return (volatile uint32_t *)(sim.periph + offset);
+}
+
+static volatile uint32_t *sim_bus_to_virt(uint32_t bus_addr)
+{
+	struct sim_region *r = sim.last_region;
+
+	if ((bus_addr & 0xff000000) == SIM_PERIPH_PHYS) {
+		if (bus_addr - SIM_PERIPH_PHYS >= SIM_PERIPH_LEN) {
+			return NULL;
+		}
+		return sim_periph_reg(bus_addr - SIM_PERIPH_PHYS);
+	}
+
+	if (!r || bus_addr - r->bus_addr >= r->size) {
+		pthread_mutex_lock(&sim.lock);
+		for (r = sim.regions; r; r = r->next) {
+			if (bus_addr - r->bus_addr < r->size) {
+				break;
+			}
+		}
+		sim.last_region = r;
+		pthread_mutex_unlock(&sim.lock);
+
+		if (!r) {
+			return NULL;
+		}
+	}
+
+	return (volatile uint32_t *)(r->virt + (bus_addr - r->bus_addr));
+}
+
+static uint32_t sim_pace_us(uint32_t permap)
+{
+	switch (permap) {
+	case PERMAP_PWM:
+		/* PWM clock is set up for 1 MHz, so the range is in us */
+		return *sim_periph_reg(PWM_BASE_OFFSET + PWM_RNG1);
+	case PERMAP_PCM_TX:
+		return ((*sim_periph_reg(PCM_BASE_OFFSET + PCM_MODE_A) >> 10) & 0x3ff) + 1;
+	default:
+		return 0;
+	}
+}
+
+/* Keep virtual time from running ahead of real time */
+static void sim_sync(void)
+{
+	uint64_t real = sim_real_us();
+
+	if (sim.now_us > real + SIM_SLACK_US) {
+		sim_sleep_until(sim.now_us);
+	} else if (real > sim.now_us + SIM_LATE_US) {
+		sim.stats.late_us += real - sim.now_us;
+		sim.now_us = real;
+	}
+}
+
+/* Block until there's space in the pacer's FIFO for another word */
+static void sim_pace(uint32_t permap)
+{
+	uint64_t pace = sim_pace_us(permap);
+	uint64_t full = (PACER_FIFO_DEPTH - 1) * pace;
+
+	if (!pace) {
+		return;
+	}
+
+	if (sim.fifo_empty_us < sim.now_us) {
+		/* FIFO ran dry */
+		sim.fifo_empty_us = sim.now_us;
+	} else if (sim.fifo_empty_us > sim.now_us + full) {
+		sim.now_us = sim.fifo_empty_us - full;
+	}
+	sim.fifo_empty_us += pace;
+
+	sim_sync();
+}
+
+static void sim_gpio_write(uint32_t offset, uint32_t val)
+{
+	volatile uint32_t *lev = sim_periph_reg(GPIO_BASE_OFFSET + GPIO_LEV0);
+
+	if (!val) {
+		return;
+	}
+
+	if (offset == GPIO_SET0) {
+		*lev |= val;
+	} else {
+		*lev &= ~val;
+	}
+	sim.stats.gpio_level = *lev;
+	sim.stats.gpio_writes++;
+
+	if (sim.trace) {
+		fprintf(sim.trace, "%llu %c %08x\n", (unsigned long long)sim.now_us,
+			offset == GPIO_SET0 ? 'S' : 'C', val);
+	}
+}
+
+static void sim_write(uint32_t bus_addr, uint32_t val)
+{
+	volatile uint32_t *p = sim_bus_to_virt(bus_addr);
+	uint32_t offset = bus_addr - (SIM_PERIPH_PHYS + GPIO_BASE_OFFSET);
+
+	if (offset == GPIO_SET0 || offset == GPIO_CLR0) {
+		sim_gpio_write(offset, val);
+		return;
+	}
+
+	if (p) {
+		*p = val;
+	}
+}
+
+static uint32_t sim_read(uint32_t bus_addr)
+{
+	volatile uint32_t *p = sim_bus_to_virt(bus_addr);
+
+	return p ? *p : 0;
+}
+
+static volatile uint32_t *sim_dma_regs(int ch)
+{
+	return sim_periph_reg(DMA_BASE_OFFSET + (ch * DMA_CHAN_SIZE));
+}
+
+static void sim_dma_stop(int ch, uint32_t cs_set)
+{
+	volatile uint32_t *regs = sim_dma_regs(ch);
+
+	regs[DMA_CONBLK_AD] = 0;
+	regs[DMA_CS] = (regs[DMA_CS] & ~DMA_ACTIVE) | cs_set;
+	sim.chans[ch].running = false;
+}
+
+/* Run one control block, exactly as the DMA engine would */
+static void sim_dma_exec(int ch, uint32_t cb_addr)
+{
+	volatile uint32_t *regs = sim_dma_regs(ch);
+	volatile uint32_t *cb = sim_bus_to_virt(cb_addr);
+	uint32_t ti, src, dst, len, stride, rows, xlen, row, x, val;
+
+	if (!cb) {
+		fprintf(stderr, "pi_sim: DMA %d: bad CB address %08x\n", ch, cb_addr);
+		regs[DMA_DEBUG] |= DMA_DEBUG_READ_ERROR;
+		sim_dma_stop(ch, 0);
+		return;
+	}
+
+	ti = cb[0];
+	src = cb[1];
+	dst = cb[2];
+	len = cb[3];
+	stride = cb[4];
+
+	/* The next pointer is latched when the CB is loaded */
+	regs[DMA_CONBLK_AD] = cb_addr;
+	regs[DMA_TI] = ti;
+	regs[DMA_SOURCE_AD] = src;
+	regs[DMA_DEST_AD] = dst;
+	regs[DMA_TXFR_LEN] = len;
+	regs[DMA_STRIDE] = stride;
+	regs[DMA_NEXTCONBK] = cb[5];
+	sim.chans[ch].cb_addr = cb[5];
+
+	if (ti & DMA_TDMODE) {
+		rows = ((len >> 16) & 0x3fff) + 1;
+		xlen = len & 0xffff;
+	} else {
+		rows = 1;
+		xlen = len & 0x3fffffff;
+	}
+
+	for (row = 0; row < rows; row++) {
+		if (ti & DMA_TDMODE) {
+			regs[DMA_TXFR_LEN] = ((rows - row - 1) << 16) | xlen;
+		}
+
+		for (x = 0; x < xlen; x += 4) {
+			val = (ti & DMA_SRC_IGNORE) ? 0 : sim_read(src);
+			if (ti & DMA_D_DREQ) {
+				sim_pace(DMA_PERMAP(ti));
+			}
+			sim_write(dst, val);
+
+			if (ti & DMA_SRC_INC) {
+				src += 4;
+			}
+			if (ti & DMA_DEST_INC) {
+				dst += 4;
+			}
+		}
+
+		if (ti & DMA_TDMODE) {
+			src += (int16_t)(stride & 0xffff);
+			dst += (int16_t)(stride >> 16);
+		}
+	}
+
+	sim.stats.cbs++;
+}
+
+/* Returns true if the channel did some work */
+static bool sim_dma_step(int ch)
+{
+	volatile uint32_t *regs = sim_dma_regs(ch);
+	struct sim_chan *chan = &sim.chans[ch];
+	uint32_t cs = regs[DMA_CS];
+
+	if (cs & DMA_RESET) {
+		regs[DMA_CS] = 0;
+		chan->running = false;
+		return false;
+	}
+
+	if (!(cs & DMA_ACTIVE)) {
+		chan->running = false;
+		return false;
+	}
+
+	if (!chan->running) {
+		chan->running = true;
+		chan->cb_addr = regs[DMA_CONBLK_AD];
+	}
+
+	if (!chan->cb_addr) {
+		sim.stats.chain_ends++;
+		sim_dma_stop(ch, DMA_END);
+		return false;
+	}
+
+	sim_dma_exec(ch, chan->cb_addr);
+
+	return true;
+}
+
+static void *sim_thread(void *arg)
+{
+	uint64_t next_print = 1000000;
+	bool busy;
+	int ch;
+
+	while (1) {
+		busy = false;
+		for (ch = 0; ch < DMA_N_CHANS; ch++) {
+			busy |= sim_dma_step(ch);
+		}
+
+		if (!busy) {
+			sim_sleep_until(sim_real_us() + SIM_IDLE_US);
+			if (sim.now_us < sim_real_us()) {
+				sim.now_us = sim_real_us();
+			}
+		}
+
+		if (sim.print_stats && sim.now_us >= next_print) {
+			fprintf(stderr, "pi_sim: %llu us: %llu CBs, %llu GPIO writes, "
+				"%llu chain ends, %llu us late\n",
+				(unsigned long long)sim.now_us,
+				(unsigned long long)sim.stats.cbs,
+				(unsigned long long)sim.stats.gpio_writes,
+				(unsigned long long)sim.stats.chain_ends,
+				(unsigned long long)sim.stats.late_us);
+			next_print += 1000000;
+		}
+
+		if (sim.trace && !busy) {
+			fflush(sim.trace);
+		}
+	}
+
+	return NULL;
+}
+
+static void sim_init(void)
+{
+	const char *trace = getenv("PI_SIM_TRACE");
+
+	sim.periph_fd = memfd_create("pi_sim_periph", 0);
+	if (sim.periph_fd < 0 || ftruncate(sim.periph_fd, SIM_PERIPH_LEN)) {
+		perror("pi_sim: Couldn't create peripheral memory");
+		exit(1);
+	}
+
+	sim.periph = mmap(NULL, SIM_PERIPH_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  sim.periph_fd, 0);
+	if (sim.periph == MAP_FAILED) {
+		perror("pi_sim: Couldn't map peripheral memory");
+		exit(1);
+	}
+
+	if (trace) {
+		sim.trace = fopen(trace, "w");
+		if (!sim.trace) {
+			perror("pi_sim: Couldn't open trace file");
+		}
+	}
+	sim.print_stats = getenv("PI_SIM_STATS") != NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &sim.epoch);
+
+	if (pthread_create(&sim.thread, NULL, sim_thread, NULL)) {
+		fprintf(stderr, "pi_sim: Couldn't start simulator thread\n");
+		exit(1);
+	}
+}
+
+void pi_sim_get_stats(struct pi_sim_stats *stats)
+{
+	pthread_once(&sim.once, sim_init);
+
+	*stats = sim.stats;
+	stats->now_us = sim.now_us;
+}
+
+int get_model_and_revision(struct board_cfg *board)
+{
+	pthread_once(&sim.once, sim_init);
+
+	board->mem_flag = 0x04;
+	board->periph_virt_base = SIM_PERIPH_VIRT;
+	board->dram_phys_base = 0;
+	board->periph_phys_base = SIM_PERIPH_PHYS;
+
+	return 0;
+}
+
+uint32_t *map_peripheral(uint32_t base, size_t len)
+{
+	void *vaddr;
+
+	pthread_once(&sim.once, sim_init);
+
+	if (base < SIM_PERIPH_VIRT || base + len > SIM_PERIPH_VIRT + SIM_PERIPH_LEN) {
+		fprintf(stderr, "pi_sim: No peripheral at %08x\n", base);
+		return MAP_FAILED;
+	}
+
+	vaddr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		     sim.periph_fd, base - SIM_PERIPH_VIRT);
+	if (vaddr == MAP_FAILED) {
+		perror("Failed to map peripheral");
+	}
+
+	return vaddr;
+}
+
+struct phys *phys_alloc(struct board_cfg *board, size_t len)
+{
+	struct sim_region *r;
+	struct phys *p = calloc(1, sizeof(*p));
+	if (!p) {
+		return NULL;
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (!r) {
+		goto fail;
+	}
+
+	p->handle = -1;
+	p->size = (len + 4095) & ~4095;
+	p->virt_addr = mmap(NULL, p->size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (p->virt_addr == MAP_FAILED) {
+		perror("pi_sim: Couldn't allocate phys");
+		goto fail;
+	}
+
+	pthread_mutex_lock(&sim.lock);
+	p->mem_ref = sim.next_bus;
+	p->bus_addr = sim.next_bus;
+	p->phys_addr = BUS_TO_PHYS(p->bus_addr);
+	sim.next_bus += p->size;
+
+	r->bus_addr = p->bus_addr;
+	r->size = p->size;
+	r->virt = p->virt_addr;
+	r->next = sim.regions;
+	sim.regions = r;
+	pthread_mutex_unlock(&sim.lock);
+
+	return p;
+
+fail:
+	free(r);
+	free(p);
+	return NULL;
+}
+
+void phys_free(struct phys *p)
+{
+	struct sim_region **r;
+
+	pthread_mutex_lock(&sim.lock);
+	for (r = &sim.regions; *r; r = &(*r)->next) {
+		if ((*r)->bus_addr == p->bus_addr) {
+			struct sim_region *tmp = *r;
+			*r = tmp->next;
+			free(tmp);
+			break;
+		}
+	}
+	sim.last_region = NULL;
+	pthread_mutex_unlock(&sim.lock);
+
+	munmap(p->virt_addr, p->size);
+	free(p);
+}
+
+uint32_t phys_virt_to_bus(struct phys *p, void *virt)
+{
+	uint32_t offset = (uint8_t *)virt - p->virt_addr;
+
+	return p->bus_addr + offset;
+}
+
+uint32_t phys_virt_to_phys(struct phys *p, void *virt)
+{
+	uint32_t offset = (uint8_t *)virt - p->virt_addr;
+
+	return p->phys_addr + offset;
+}
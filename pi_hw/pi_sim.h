@@ -0,0 +1,52 @@
+/*
+ * pi_sim.h Userspace simulation of the BCM283x DMA, PWM and GPIO
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __PI_SIM_H__
+#define __PI_SIM_H__
+#include <stdint.h>
+
+/*
+ * pi_sim.c implements the pi_util.h interface on top of fake peripheral
+ * and "physical" memory, so that the rest of pi_hw and pi_backend run
+ * unmodified on any Linux machine.
+ *
+ * A simulator thread executes DMA CB chains in real time, pacing DREQ
+ * transfers with a virtual PWM/PCM FIFO, and records every GPIO set/clear.
+ *
+ * Environment variables:
+ *   PI_SIM_TRACE=<file>  Write "<time_us> S|C <mask>" for each GPIO write
+ *   PI_SIM_STATS=1       Print the simulator stats to stderr every second
+ */
+
+struct pi_sim_stats {
+	/* Control blocks executed */
+	uint64_t cbs;
+	/* Non-zero writes to GPSET0/GPCLR0 */
+	uint64_t gpio_writes;
+	/* Times a DMA channel ran off the end of its CB chain */
+	uint64_t chain_ends;
+	/* Total time the simulator has fallen behind real time */
+	uint64_t late_us;
+	/* Current virtual time */
+	uint64_t now_us;
+	/* Current GPIO levels (pins 0-31) */
+	uint32_t gpio_level;
+};
+
+void pi_sim_get_stats(struct pi_sim_stats *stats);
+
+#endif /* __PI_SIM_H__ */
@@ -15,21 +15,64 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "pi_backend.h"
 #include "pi_hw/pi_gpio.h"
 #include "pi_hw/pi_util.h"
+#include "pipe_backend.h"
 #include "platform.h"
+#include "tee_backend.h"
+#include "trace_backend.h"
+
+#define N_SEGMENTS 2
 
 struct platform {
 	struct board_cfg board;
 	struct gpio_dev *gpio;
 	struct pi_backend *be;
+
+	/* Only if recording to $YAPIDH_TRACE */
+	struct trace_backend *trace;
+	struct tee_backend *tee;
+	/* Only if $YAPIDH_PIPELINE is set */
+	struct pipe_backend *pipe;
 };
 
+/* The backend which drives the DMA, possibly via the recording tee */
+static struct wave_backend *pi_platform_output(struct platform *p)
+{
+	if (p->tee) {
+		return &p->tee->base;
+	}
+
+	return (struct wave_backend *)p->be;
+}
+
+static int pi_platform_wait(void *data, int timeout_millis)
+{
+	struct platform *p = data;
+	int ret;
+
+	gpio_debug_set(p->gpio, 1 << DBG_FENCE_PIN);
+	ret = pi_backend_wait_fence_precise(p->be, timeout_millis);
+	gpio_debug_clear(p->gpio, 1 << DBG_FENCE_PIN);
+	return ret;
+}
+
 void platform_fini(struct platform *p)
 {
+	if (p->pipe) {
+		pipe_backend_fini(p->pipe);
+	}
+	if (p->tee) {
+		tee_backend_fini(p->tee);
+	}
+	if (p->trace) {
+		trace_backend_fini(p->trace);
+	}
 	if (p->be) {
 		pi_backend_destroy(p->be);
 	}
@@ -42,6 +85,7 @@ void platform_fini(struct platform *p)
 struct platform *platform_init(uint32_t pins)
 {
 	int ret, i;
+	const char *trace;
 	struct platform *p = calloc(1, sizeof(*p));
 	if (!p) {
 		return NULL;
@@ -84,11 +128,45 @@ struct platform *platform_init(uint32_t pins)
 	usleep(100);
 #endif
 
-	p->be = pi_backend_create(&p->board, p->gpio);
+	p->be = pi_backend_create(&p->board, p->gpio, N_SEGMENTS);
 	if (!p->be) {
 		fprintf(stderr, "Couldn't get backend\n");
 		goto fail;
 	}
+	pi_backend_set_safe_state(p->be, 0, pins);
+
+	/* Build straight into DMA memory, to compare with staging */
+	if (getenv("YAPIDH_DIRECT")) {
+		pi_backend_set_staging(p->be, false);
+	}
+
+	/* Record a copy of the output, off the DMA's critical path */
+	trace = getenv("YAPIDH_TRACE");
+	if (trace) {
+		p->trace = trace_backend_create(pins, trace);
+		if (!p->trace) {
+			goto fail;
+		}
+
+		p->tee = tee_backend_create((struct wave_backend *)p->be,
+					   &p->trace->base, TEE_RING_LEN);
+		if (!p->tee) {
+			fprintf(stderr, "Couldn't start recording\n");
+			goto fail;
+		}
+	}
+
+	/*
+	 * Generate on the calling thread, and build the CBs on another one,
+	 * which waits for the fences instead
+	 */
+	if (getenv("YAPIDH_PIPELINE")) {
+		p->pipe = pipe_backend_create(pi_platform_output(p), pi_platform_wait, p);
+		if (!p->pipe) {
+			fprintf(stderr, "Couldn't start pipeline\n");
+			goto fail;
+		}
+	}
 
 	return p;
 
@@ -99,17 +177,43 @@ fail:
 
 struct wave_backend *platform_get_backend(struct platform *p)
 {
-	return (struct wave_backend *)p->be;
+	if (p->pipe) {
+		return &p->pipe->base;
+	}
+
+	return pi_platform_output(p);
 }
 
 int platform_sync(struct platform *p, int timeout_millis) {
-	int ret;
-	gpio_debug_set(p->gpio, 1 << DBG_FENCE_PIN);
-	ret = pi_backend_wait_fence(p->be, timeout_millis, 4);
-	gpio_debug_clear(p->gpio, 1 << DBG_FENCE_PIN);
-	return ret;
+	if (p->pipe) {
+		return pipe_backend_sync(p->pipe, timeout_millis);
+	}
+
+	return pi_platform_wait(p, timeout_millis);
 }
 
 void platform_dump(struct platform *p) {
 	pi_backend_dump(p->be);
 }
+
+void platform_get_stats(struct platform *p, struct platform_stats *stats)
+{
+	struct pi_backend_stats be_stats;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pi_backend_get_stats(p->be, &be_stats);
+	stats->underruns = be_stats.underruns;
+	stats->truncated = be_stats.truncated;
+
+	if (p->pipe) {
+		struct pipe_stats pipe_stats;
+
+		pipe_backend_get_stats(p->pipe, &pipe_stats);
+		stats->gen_ns = pipe_stats.gen_ns;
+		stats->stall_ns = pipe_stats.stall_ns;
+		stats->wait_ns = pipe_stats.wait_ns;
+		stats->encode_ns = pipe_stats.encode_ns;
+		stats->chunks = pipe_stats.chunks;
+	}
+}
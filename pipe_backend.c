@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pipe_backend.h"
+#include "types.h"
+
+static uint64_t pipe_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Called with the lock held. Returns -1 on timeout */
+static int pipe_backend_wait_free(struct pipe_backend *pb, struct pipe_chunk *chunk,
+				  int timeout_millis)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_millis / 1000;
+	ts.tv_nsec += (timeout_millis % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while (chunk->ready) {
+		if (pthread_cond_timedwait(&pb->cond, &pb->lock, &ts) == ETIMEDOUT) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void pipe_backend_push(struct pipe_backend *pb, uint32_t set, uint32_t clear,
+			      int delay)
+{
+	struct pipe_chunk *chunk = pb->fill;
+	struct pipe_slot *slot;
+
+	if (chunk->n_slots == chunk->max_slots) {
+		int max = chunk->max_slots * 2;
+
+		slot = realloc(chunk->slots, max * sizeof(*slot));
+		if (!slot) {
+			/* Keep the timing right, at least */
+			fprintf(stderr, "pipe: Out of memory, dropping edges\n");
+			chunk->slots[chunk->n_slots - 1].delay += delay;
+			return;
+		}
+		chunk->slots = slot;
+		chunk->max_slots = max;
+	}
+
+	slot = &chunk->slots[chunk->n_slots++];
+	slot->set = set;
+	slot->clear = clear;
+	slot->delay = delay;
+}
+
+static void pipe_backend_emit_event(struct wave_backend *wb, const struct event *ev)
+{
+	struct pipe_backend *pb = (struct pipe_backend *)wb;
+	uint32_t bit;
+
+	switch (ev->type) {
+	case EVENT_RISING_EDGE:
+		pb->rising |= (1 << ev->channel);
+		break;
+	case EVENT_FALLING_EDGE:
+		pb->falling |= (1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		pb->rising |= ev->rising;
+		pb->falling |= ev->falling;
+		break;
+	case EVENT_TOGGLE:
+		bit = 1 << ev->channel;
+		if (((pb->level | pb->rising) & ~pb->falling) & bit) {
+			pb->rising &= ~bit;
+			pb->falling |= bit;
+		} else {
+			pb->falling &= ~bit;
+			pb->rising |= bit;
+		}
+		break;
+	case EVENT_NONE:
+		break;
+	}
+}
+
+static void pipe_backend_add_event(struct wave_backend *wb, struct source *s)
+{
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	pipe_backend_emit_event(wb, &ev);
+}
+
+static void pipe_backend_add_delay(struct wave_backend *wb, int delay)
+{
+	struct pipe_backend *pb = (struct pipe_backend *)wb;
+
+	pipe_backend_push(pb, pb->rising, pb->falling, delay);
+
+	pb->level = (pb->level | pb->rising) & ~pb->falling;
+	pb->rising = pb->falling = 0;
+}
+
+/* Expand runs straight into the chunk, the same as pi_backend would */
+static int pipe_backend_add_run(struct wave_backend *wb, struct step_run *run, int limit)
+{
+	struct pipe_backend *pb = (struct pipe_backend *)wb;
+	uint32_t bit = 1 << run->channel;
+	int ticks = 0;
+
+	while (run->count) {
+		int interval = step_run_interval(run);
+		int delay = step_run_clip(run, ticks, limit);
+
+		if (!delay) {
+			break;
+		}
+
+		if (run->pulsewidth) {
+			pipe_backend_push(pb, bit, 0, run->pulsewidth);
+			pipe_backend_push(pb, 0, bit, delay - run->pulsewidth);
+			pb->level &= ~bit;
+		} else {
+			pb->level ^= bit;
+			pipe_backend_push(pb, pb->level & bit, ~pb->level & bit, delay);
+		}
+
+		ticks += interval;
+		step_run_advance(run);
+	}
+
+	return ticks;
+}
+
+static void pipe_backend_start_wave(struct wave_backend *wb)
+{
+	struct pipe_backend *pb = (struct pipe_backend *)wb;
+	struct pipe_chunk *chunk = &pb->chunks[pb->fill_idx];
+	uint64_t start = pipe_now_ns();
+
+	pthread_mutex_lock(&pb->lock);
+	while (chunk->ready) {
+		pthread_cond_wait(&pb->cond, &pb->lock);
+	}
+	pb->gen_start = pipe_now_ns();
+	pb->stats.stall_ns += pb->gen_start - start;
+	pthread_mutex_unlock(&pb->lock);
+
+	chunk->n_slots = 0;
+	pb->fill = chunk;
+}
+
+static void pipe_backend_end_wave(struct wave_backend *wb)
+{
+	struct pipe_backend *pb = (struct pipe_backend *)wb;
+	uint64_t end = pipe_now_ns();
+
+	pthread_mutex_lock(&pb->lock);
+	pb->fill->ready = true;
+	pb->stats.gen_ns += end - pb->gen_start;
+	pb->stats.slots += pb->fill->n_slots;
+	pb->stats.chunks++;
+	pthread_cond_broadcast(&pb->cond);
+	pthread_mutex_unlock(&pb->lock);
+
+	pb->fill = NULL;
+	pb->fill_idx = (pb->fill_idx + 1) % PIPE_CHUNKS;
+}
+
+static void pipe_backend_encode(struct pipe_backend *pb, struct pipe_chunk *chunk)
+{
+	struct wave_backend *be = pb->primary;
+	struct event ev = { .type = EVENT_EDGES };
+	int i;
+
+	if (be->start_wave) {
+		be->start_wave(be);
+	}
+
+	for (i = 0; i < chunk->n_slots; i++) {
+		struct pipe_slot *slot = &chunk->slots[i];
+
+		if (slot->set | slot->clear) {
+			ev.rising = slot->set;
+			ev.falling = slot->clear;
+			be->emit_event(be, &ev);
+		}
+		be->add_delay(be, slot->delay);
+	}
+
+	if (be->end_wave) {
+		be->end_wave(be);
+	}
+}
+
+static void *pipe_encode_thread(void *arg)
+{
+	struct pipe_backend *pb = arg;
+	uint64_t start, encode_start, end;
+	int ret;
+
+	pthread_mutex_lock(&pb->lock);
+	while (1) {
+		struct pipe_chunk *chunk = &pb->chunks[pb->encode_idx];
+
+		while (!chunk->ready && !pb->stop) {
+			pthread_cond_wait(&pb->cond, &pb->lock);
+		}
+		if (!chunk->ready) {
+			break;
+		}
+		pthread_mutex_unlock(&pb->lock);
+
+		start = pipe_now_ns();
+		ret = pb->wait ? pb->wait(pb->wait_data, 1000) : 0;
+		encode_start = pipe_now_ns();
+		pipe_backend_encode(pb, chunk);
+		end = pipe_now_ns();
+
+		pthread_mutex_lock(&pb->lock);
+		if (ret && !pb->error) {
+			pb->error = ret;
+		}
+		pb->stats.wait_ns += encode_start - start;
+		pb->stats.encode_ns += end - encode_start;
+		chunk->ready = false;
+		pb->encode_idx = (pb->encode_idx + 1) % PIPE_CHUNKS;
+		pthread_cond_broadcast(&pb->cond);
+	}
+	pthread_mutex_unlock(&pb->lock);
+
+	return NULL;
+}
+
+int pipe_backend_sync(struct pipe_backend *pb, int timeout_millis)
+{
+	int ret;
+
+	pthread_mutex_lock(&pb->lock);
+	ret = pipe_backend_wait_free(pb, &pb->chunks[pb->fill_idx], timeout_millis);
+	if (!ret) {
+		ret = pb->error;
+	}
+	pthread_mutex_unlock(&pb->lock);
+
+	return ret;
+}
+
+void pipe_backend_get_stats(struct pipe_backend *pb, struct pipe_stats *stats)
+{
+	pthread_mutex_lock(&pb->lock);
+	*stats = pb->stats;
+	pthread_mutex_unlock(&pb->lock);
+}
+
+void pipe_backend_fini(struct pipe_backend *pb)
+{
+	int i;
+
+	if (pb->running) {
+		pthread_mutex_lock(&pb->lock);
+		pb->stop = true;
+		pthread_cond_broadcast(&pb->cond);
+		pthread_mutex_unlock(&pb->lock);
+		pthread_join(pb->thread, NULL);
+	}
+
+	pthread_cond_destroy(&pb->cond);
+	pthread_mutex_destroy(&pb->lock);
+	for (i = 0; i < PIPE_CHUNKS; i++) {
+		free(pb->chunks[i].slots);
+	}
+	free(pb);
+}
+
+struct pipe_backend *pipe_backend_create(struct wave_backend *primary,
+					 int (*wait)(void *data, int timeout_millis),
+					 void *wait_data)
+{
+	struct pipe_backend *pb = calloc(1, sizeof(*pb));
+	int i;
+
+	if (!pb) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&pb->lock, NULL);
+	pthread_cond_init(&pb->cond, NULL);
+
+	pb->primary = primary;
+	pb->wait = wait;
+	pb->wait_data = wait_data;
+
+	pb->base.start_wave = pipe_backend_start_wave;
+	pb->base.add_delay = pipe_backend_add_delay;
+	pb->base.add_event = pipe_backend_add_event;
+	pb->base.emit_event = pipe_backend_emit_event;
+	pb->base.add_run = pipe_backend_add_run;
+	pb->base.end_wave = pipe_backend_end_wave;
+
+	for (i = 0; i < PIPE_CHUNKS; i++) {
+		pb->chunks[i].slots = calloc(PIPE_CHUNK_SLOTS, sizeof(struct pipe_slot));
+		if (!pb->chunks[i].slots) {
+			goto fail;
+		}
+		pb->chunks[i].max_slots = PIPE_CHUNK_SLOTS;
+	}
+
+	if (pthread_create(&pb->thread, NULL, pipe_encode_thread, pb)) {
+		fprintf(stderr, "pipe: Couldn't start encoder thread\n");
+		goto fail;
+	}
+	pb->running = true;
+
+	return pb;
+
+fail:
+	pipe_backend_fini(pb);
+	return NULL;
+}
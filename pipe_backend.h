@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __PIPE_BACKEND_H__
+#define __PIPE_BACKEND_H__
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wave_gen.h"
+
+/* Chunks which can be in flight between wave_gen and the encoder thread */
+#define PIPE_CHUNKS 2
+/* Initial slots per chunk. Chunks grow as needed */
+#define PIPE_CHUNK_SLOTS 4096
+
+struct pipe_slot {
+	uint32_t set;
+	uint32_t clear;
+	int delay;
+};
+
+struct pipe_chunk {
+	struct pipe_slot *slots;
+	int n_slots;
+	int max_slots;
+	/* Filled in, and waiting for the encoder */
+	bool ready;
+};
+
+struct pipe_stats {
+	/* wave_gen's thread: time from start_wave to end_wave */
+	uint64_t gen_ns;
+	/* wave_gen's thread: time waiting for the encoder to free a chunk */
+	uint64_t stall_ns;
+	/* Encoder thread: time waiting in the wait() hook */
+	uint64_t wait_ns;
+	/* Encoder thread: time replaying chunks into the primary */
+	uint64_t encode_ns;
+	uint64_t slots;
+	unsigned int chunks;
+};
+
+/*
+ * Splits generation into two stages. wave_gen() and the sources write each
+ * slot into a plain buffer on the calling thread, and an encoder thread
+ * replays finished chunks into primary (e.g. pi_backend), one wave per chunk.
+ *
+ * Before each chunk, the encoder thread calls wait(), which should block
+ * until primary can take another wave - i.e. what platform_sync() would
+ * otherwise do. The caller should use pipe_backend_sync() instead.
+ */
+struct pipe_backend {
+	struct wave_backend base;
+	struct wave_backend *primary;
+	int (*wait)(void *data, int timeout_millis);
+	void *wait_data;
+
+	/* Only touched by wave_gen's thread */
+	uint32_t rising;
+	uint32_t falling;
+	uint32_t level;
+	struct pipe_chunk *fill;
+	int fill_idx;
+	uint64_t gen_start;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pipe_chunk chunks[PIPE_CHUNKS];
+	int encode_idx;
+	bool stop;
+	/* First error from wait(), for pipe_backend_sync() to return */
+	int error;
+	struct pipe_stats stats;
+
+	pthread_t thread;
+	bool running;
+};
+
+struct pipe_backend *pipe_backend_create(struct wave_backend *primary,
+					 int (*wait)(void *data, int timeout_millis),
+					 void *wait_data);
+/* Waits for everything queued to be encoded, and stops the encoder thread */
+void pipe_backend_fini(struct pipe_backend *pb);
+
+/* Wait for a free chunk. Returns an error from wait() if there was one */
+int pipe_backend_sync(struct pipe_backend *pb, int timeout_millis);
+void pipe_backend_get_stats(struct pipe_backend *pb, struct pipe_stats *stats);
+
+#endif /* __PIPE_BACKEND_H__ */
@@ -20,12 +20,31 @@
 
 struct platform;
 
+struct platform_stats {
+	/* Number of times the output ran dry before the next wave was ready */
+	unsigned int underruns;
+	/* Number of waves which ran out of room, and had edges dropped */
+	unsigned int truncated;
+
+	/*
+	 * Only for pipelined platforms: time spent generating chunks, waiting
+	 * for the encoder to take them, waiting for the output to have room
+	 * for them, and encoding them, in ns
+	 */
+	uint64_t gen_ns;
+	uint64_t stall_ns;
+	uint64_t wait_ns;
+	uint64_t encode_ns;
+	unsigned int chunks;
+};
+
 struct platform *platform_init(uint32_t pins);
 void platform_fini(struct platform *p);
 
 struct wave_backend *platform_get_backend(struct platform *);
 int platform_sync(struct platform *, int timeout_millis);
 void platform_dump(struct platform *p);
+void platform_get_stats(struct platform *p, struct platform_stats *stats);
 
 #endif /* __PLATFORM_H__ */
 
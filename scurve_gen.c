@@ -0,0 +1,125 @@
+/*
+ * scurve_gen.c Jerk-limited stepper motor profile generator
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <stdio.h>
+#include <math.h>
+
+#include "scurve_gen.h"
+
+void scurve_set_speed(struct scurve_ctx *c, double speed)
+{
+	c->steady = 0;
+	c->target_v = speed / (c->alpha * c->f);
+}
+
+/*
+ * Starting from rest with acceleration ramping up at the jerk limit, the
+ * first step is at t = cbrt(6 / jerk)
+ */
+static void scurve_first_step(struct scurve_ctx *c)
+{
+	double t = cbrt(6 / c->jerk);
+
+	c->a = c->jerk * t;
+	if (c->a > c->a_max) {
+		c->a = c->a_max;
+	}
+	c->v = c->jerk * t * t / 2;
+	if (c->v > c->target_v) {
+		c->v = c->target_v;
+	}
+	c->c = t;
+}
+
+void scurve_tick(struct scurve_ctx *c)
+{
+	double dt = c->c;
+	double dv = c->target_v - c->v;
+	double dir = dv > 0 ? 1 : -1;
+	double a_dir;
+
+	if (c->steady) {
+		return;
+	}
+
+	if (c->v == 0.0f) {
+		if (c->target_v == 0.0f) {
+			// Disable motor.
+			c->steady = 1;
+			return;
+		}
+
+		scurve_first_step(c);
+		return;
+	}
+
+	/*
+	 * If taking the acceleration back to zero at the jerk limit would use
+	 * up the rest of the speed change, start doing that. Otherwise keep
+	 * increasing it, up to the limit.
+	 */
+	a_dir = c->a * dir;
+	if (a_dir > 0 && (dv * dir) <= (a_dir * a_dir) / (2 * c->jerk)) {
+		a_dir -= c->jerk * dt;
+		if (a_dir < 0) {
+			a_dir = 0;
+		}
+	} else {
+		a_dir += c->jerk * dt;
+		if (a_dir > c->a_max) {
+			a_dir = c->a_max;
+		}
+	}
+	c->a = a_dir * dir;
+
+	c->v += c->a * dt;
+	if ((c->target_v - c->v) * dir <= 0) {
+		c->v = c->target_v;
+		c->a = 0;
+		c->steady = 1;
+	}
+
+	if (c->v <= 0) {
+		/* Stopped */
+		c->v = 0;
+		return;
+	}
+
+	c->c = 1 / c->v;
+}
+
+void scurve_ctx_dump(struct scurve_ctx *c)
+{
+	fprintf(stderr, "------\n");
+	fprintf(stderr, "Alpha   : %4.3f\n", c->alpha);
+	fprintf(stderr, "Freq    : %4.3f\n", c->f);
+	fprintf(stderr, "a_max   : %4.3f\n", c->a_max * c->alpha * c->f * c->f);
+	fprintf(stderr, "jerk    : %4.3f\n", c->jerk * c->alpha * c->f * c->f * c->f);
+	fprintf(stderr, "a       : %4.3f\n", c->a * c->alpha * c->f * c->f);
+	fprintf(stderr, "c       : %4.3f\n", c->c);
+	fprintf(stderr, "speed   : %4.3f\n", c->v * c->alpha * c->f);
+	fprintf(stderr, "------\n");
+}
+
+void scurve_ctx_init(struct scurve_ctx *ctx, int steps_per_rev, double timer_freq,
+		     double accel_radss, double jerk_radsss)
+{
+	ctx->alpha = (2 * M_PI) / steps_per_rev;
+	ctx->f = timer_freq;
+	ctx->a_max = accel_radss / (ctx->alpha * timer_freq * timer_freq);
+	ctx->jerk = jerk_radsss / (ctx->alpha * timer_freq * timer_freq * timer_freq);
+}
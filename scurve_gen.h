@@ -0,0 +1,54 @@
+/*
+ * scurve_gen.h Jerk-limited stepper motor profile generator
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __SCURVE_GEN_H__
+#define __SCURVE_GEN_H__
+
+/*
+ * S-curve speed profiles: the acceleration ramps up and down at a bounded
+ * jerk instead of switching on and off.
+ *
+ * The profile is integrated one step at a time, using the previous step
+ * interval as the time step, so each tick costs one division, like
+ * stepper_tick(). Units are steps and timer ticks internally.
+ */
+struct scurve_ctx {
+	double alpha;
+	double f;
+
+	/* Limits, in steps/tick^2 and steps/tick^3 */
+	double a_max;
+	double jerk;
+
+	/* Speed and acceleration, in steps/tick and steps/tick^2 */
+	double v;
+	double a;
+	double target_v;
+
+	/* Interval until the next step, in ticks */
+	double c;
+
+	int steady;
+};
+
+void scurve_set_speed(struct scurve_ctx *c, double speed);
+void scurve_tick(struct scurve_ctx *c);
+void scurve_ctx_dump(struct scurve_ctx *c);
+void scurve_ctx_init(struct scurve_ctx *ctx, int steps_per_rev, double timer_freq,
+		     double accel_radss, double jerk_radsss);
+
+#endif /* __SCURVE_GEN_H__ */
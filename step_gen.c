@@ -21,6 +21,7 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <math.h>
 
 #include "step_gen.h"
@@ -88,3 +89,258 @@ void step_ctx_init(struct step_ctx *ctx, int steps_per_rev, double timer_freq,
 	ctx->f = timer_freq;
 	ctx->accel = accel_radss;
 }
+
+void stepper_fixed_set_speed(struct step_ctx_fixed *c, double speed)
+{
+	double target_n = (speed * speed) / c->two_alpha_accel;
+
+	c->steady = 0;
+	c->stop = speed == 0.0f;
+	if (!c->stop) {
+		c->c_steady = step_fixed_from_double(c->alpha_f / speed);
+	}
+
+	/*
+	 * n only takes integer values, so "n >= target_n" is the same as
+	 * "n >= ceil(target_n)"
+	 */
+	if (target_n != 0.0f && target_n < abs(c->n)) {
+		c->target_n = ceil(-target_n);
+		c->n = -abs(c->n);
+	} else {
+		c->target_n = ceil(target_n);
+		c->n = abs(c->n);
+	}
+}
+
+/*
+ * 2c / den, for Q32.32 c. ARMv6 has no divide instruction, and a 64-bit
+ * divide is a call to __aeabi_uldivmod, which is several times slower than
+ * the 32-bit __aeabi_uidiv. So only divide the top 32 significant bits of
+ * 2c, found with CLZ (which ARMv6 does have). That keeps 2^-20 ticks or
+ * better for intervals up to 2000 ticks.
+ */
+static uint64_t stepper_fixed_dc(uint64_t c, uint32_t den)
+{
+	uint64_t c2 = c << 1;
+	int shift = 0;
+
+	if (c2 >> 32) {
+		shift = 32 - __builtin_clz(c2 >> 32);
+	}
+
+	return (uint64_t)((uint32_t)(c2 >> shift) / den) << shift;
+}
+
+void stepper_fixed_tick(struct step_ctx_fixed *c)
+{
+	uint64_t dc;
+	int32_t den;
+
+	if (c->n == 0) {
+		c->c = c->c0;
+		c->n = 1;
+		return;
+	}
+
+	if (c->n >= c->target_n) {
+		if (c->stop) {
+			// Disable motor.
+		} else if (!c->steady) {
+			c->c = c->c_steady;
+			c->steady = 1;
+		}
+
+		return;
+	}
+
+	/* c = c - 2c / (4n + 1), with n < 0 when decelerating */
+	den = (4 * c->n) + 1;
+	if (den > 0) {
+		dc = stepper_fixed_dc(c->c, den);
+		c->c -= dc;
+	} else {
+		dc = stepper_fixed_dc(c->c, -den);
+		c->c += dc;
+	}
+	c->n++;
+}
+
+void step_ctx_fixed_init(struct step_ctx_fixed *ctx, int steps_per_rev,
+			 double timer_freq, double accel_radss)
+{
+	double alpha = (2 * M_PI) / steps_per_rev;
+
+	ctx->two_alpha_accel = 2 * alpha * accel_radss;
+	ctx->alpha_f = alpha * timer_freq;
+	ctx->c0 = step_fixed_from_double(0.676 * timer_freq * sqrt((2 * alpha) / accel_radss));
+}
+
+static struct step_ramp *ramps;
+
+static uint64_t ramp_time(struct step_ramp *ramp, int n)
+{
+	return llround(ramp->f * sqrt((2 * n * ramp->alpha) / ramp->accel));
+}
+
+int step_ramp_reserve(struct step_ramp *ramp, int len)
+{
+	uint32_t *c;
+	int n;
+
+	if (len <= ramp->len) {
+		return 0;
+	}
+
+	c = realloc(ramp->c, sizeof(*c) * len);
+	if (!c) {
+		return -1;
+	}
+
+	for (n = ramp->len; n < len; n++) {
+		c[n] = ramp_time(ramp, n + 1) - ramp_time(ramp, n);
+	}
+
+	ramp->c = c;
+	ramp->len = len;
+
+	return 0;
+}
+
+uint64_t step_ramp_interval(struct step_ramp *ramp, int32_t *n, int32_t n_max,
+			    int32_t n_end, uint64_t c_cruise, int32_t remaining)
+{
+	int32_t i = *n;
+
+	/* Going too fast, or it's time to slow down for the end of the move */
+	if (i > n_max || remaining <= i - n_end) {
+		*n = i - 1;
+		return (uint64_t)ramp->c[i - 1] << STEP_FIXED_SHIFT;
+	}
+
+	/* Speed up, if there's still room to slow down afterwards */
+	if (i < n_max && remaining >= i + 2 - n_end) {
+		*n = i + 1;
+		return (uint64_t)ramp->c[i] << STEP_FIXED_SHIFT;
+	}
+
+	return i == n_max ? c_cruise : (uint64_t)ramp->c[i] << STEP_FIXED_SHIFT;
+}
+
+struct step_ramp *step_ramp_get(int steps_per_rev, double timer_freq,
+				double accel_radss)
+{
+	double alpha = (2 * M_PI) / steps_per_rev;
+	struct step_ramp *ramp;
+
+	for (ramp = ramps; ramp; ramp = ramp->next) {
+		if (ramp->alpha == alpha && ramp->f == timer_freq &&
+		    ramp->accel == accel_radss) {
+			ramp->refcount++;
+			return ramp;
+		}
+	}
+
+	ramp = calloc(1, sizeof(*ramp));
+	if (!ramp) {
+		return NULL;
+	}
+
+	ramp->alpha = alpha;
+	ramp->f = timer_freq;
+	ramp->accel = accel_radss;
+	ramp->refcount = 1;
+
+	ramp->next = ramps;
+	ramps = ramp;
+
+	return ramp;
+}
+
+void step_ramp_put(struct step_ramp *ramp)
+{
+	struct step_ramp **pp;
+
+	if (--ramp->refcount) {
+		return;
+	}
+
+	for (pp = &ramps; *pp; pp = &(*pp)->next) {
+		if (*pp == ramp) {
+			*pp = ramp->next;
+			break;
+		}
+	}
+
+	free(ramp->c);
+	free(ramp);
+}
+
+int stepper_table_set_speed(struct step_ctx_table *c, double speed)
+{
+	struct step_ramp *ramp = c->ramp;
+	double target_n = (speed * speed) / (2 * ramp->alpha * ramp->accel);
+
+	if (step_ramp_reserve(ramp, (int)ceil(target_n) + 1)) {
+		return -1;
+	}
+
+	c->steady = 0;
+	c->stop = speed == 0.0f;
+	if (!c->stop) {
+		c->c_steady = step_fixed_from_double((ramp->alpha * ramp->f) / speed);
+	}
+
+	/* Same rules as stepper_set_speed() */
+	if (target_n != 0.0f && target_n < abs(c->n)) {
+		c->target_n = ceil(-target_n);
+		c->n = -abs(c->n);
+	} else {
+		c->target_n = ceil(target_n);
+		c->n = abs(c->n);
+	}
+
+	return 0;
+}
+
+void stepper_table_tick(struct step_ctx_table *c)
+{
+	if (c->n >= c->target_n) {
+		if (c->stop) {
+			// Disable motor.
+		} else if (!c->steady) {
+			c->c = c->c_steady;
+			c->steady = 1;
+		}
+
+		return;
+	}
+
+	/*
+	 * Accelerating, n is the number of ramp steps taken so far.
+	 * Decelerating, -n is, and we walk back down the ramp.
+	 */
+	if (c->n >= 0) {
+		c->c = (uint64_t)c->ramp->c[c->n] << STEP_FIXED_SHIFT;
+	} else {
+		c->c = (uint64_t)c->ramp->c[-c->n - 1] << STEP_FIXED_SHIFT;
+	}
+	c->n++;
+}
+
+int step_ctx_table_init(struct step_ctx_table *ctx, int steps_per_rev,
+			double timer_freq, double accel_radss)
+{
+	ctx->ramp = step_ramp_get(steps_per_rev, timer_freq, accel_radss);
+	if (!ctx->ramp) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void step_ctx_table_fini(struct step_ctx_table *ctx)
+{
+	step_ramp_put(ctx->ramp);
+	ctx->ramp = NULL;
+}
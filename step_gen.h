@@ -21,6 +21,7 @@
  */
 #ifndef __STEP_GEN_H__
 #define __STEP_GEN_H__
+#include <stdint.h>
 
 struct step_ctx {
 	double alpha;
@@ -42,4 +43,107 @@ void step_ctx_dump(struct step_ctx *c);
 void step_ctx_init(struct step_ctx *ctx, int steps_per_rev, double timer_freq,
 		   double accel_radss);
 
+/*
+ * Fixed-point version of step_ctx. The interval is held as Q32.32 timer
+ * ticks, and stepper_fixed_tick() only needs one 32-bit integer division.
+ * Floating point is only used when the speed changes.
+ */
+struct step_ctx_fixed {
+	/* 2 * alpha * accel, for working out target_n */
+	double two_alpha_accel;
+	/* alpha * f, for working out the steady-state interval */
+	double alpha_f;
+
+	int32_t n;
+	int32_t target_n;
+	int stop;
+
+	/* Q32.32 ticks */
+	uint64_t c0;
+	uint64_t c_steady;
+	uint64_t c;
+
+	int steady;
+};
+
+#define STEP_FIXED_SHIFT 32
+
+static inline uint64_t step_fixed_from_double(double v)
+{
+	return (uint64_t)(v * (double)(1ULL << STEP_FIXED_SHIFT));
+}
+
+void stepper_fixed_set_speed(struct step_ctx_fixed *c, double speed);
+void stepper_fixed_tick(struct step_ctx_fixed *c);
+void step_ctx_fixed_init(struct step_ctx_fixed *ctx, int steps_per_rev,
+			 double timer_freq, double accel_radss);
+
+/* The current step interval, rounded to the nearest tick */
+static inline uint32_t stepper_fixed_interval(struct step_ctx_fixed *c)
+{
+	return (c->c + (1ULL << (STEP_FIXED_SHIFT - 1))) >> STEP_FIXED_SHIFT;
+}
+
+/*
+ * Precomputed acceleration ramp. c[n] is the interval, in whole timer
+ * ticks, between ramp steps n and n + 1 when accelerating from rest.
+ *
+ * The intervals are the differences between the exact (rounded) times of
+ * each step, t(n) = sqrt(2 * n * alpha / accel), so there's no 0.676
+ * fudge for the first step and rounding errors don't accumulate.
+ *
+ * Ramps are shared between all step_ctx_tables with the same alpha, timer
+ * frequency and acceleration, and are only ever appended to.
+ */
+struct step_ramp {
+	double alpha;
+	double f;
+	double accel;
+
+	int refcount;
+	int len;
+	uint32_t *c;
+
+	struct step_ramp *next;
+};
+
+struct step_ramp *step_ramp_get(int steps_per_rev, double timer_freq,
+				double accel_radss);
+void step_ramp_put(struct step_ramp *ramp);
+/* Make sure the ramp has at least len entries */
+int step_ramp_reserve(struct step_ramp *ramp, int len);
+
+/*
+ * Trapezoidal profile along a ramp: accelerate up to n_max while there's
+ * still room to slow down to n_end in the remaining steps, then cruise at
+ * c_cruise, then decelerate. Returns the interval after the current step,
+ * and updates the ramp index, *n. Intervals are Q32.32 ticks.
+ */
+uint64_t step_ramp_interval(struct step_ramp *ramp, int32_t *n, int32_t n_max,
+			    int32_t n_end, uint64_t c_cruise, int32_t remaining);
+
+/*
+ * Table-driven version of step_ctx. Accelerating and decelerating is a
+ * lookup in the shared ramp.
+ */
+struct step_ctx_table {
+	struct step_ramp *ramp;
+
+	int32_t n;
+	int32_t target_n;
+	int stop;
+
+	/* Q32.32 ticks, so the steady-state interval keeps its fraction */
+	uint64_t c_steady;
+	uint64_t c;
+
+	int steady;
+};
+
+int stepper_table_set_speed(struct step_ctx_table *c, double speed);
+void stepper_table_tick(struct step_ctx_table *c);
+int step_ctx_table_init(struct step_ctx_table *ctx, int steps_per_rev,
+			double timer_freq, double accel_radss);
+void step_ctx_table_fini(struct step_ctx_table *ctx);
+
 #endif /* __STEP_GEN_H__ */
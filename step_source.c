@@ -21,51 +21,639 @@
 #include "step_source.h"
 #include "types.h"
 
-static int step_source_get_delay(struct source *s)
+#define STEPS_PER_REV 600
+#define TIMER_FREQ    100000
+#define ACCEL         100
+#define JERK          1000
+
+/*
+ * Longest run at a steady speed. This doesn't hold up set_speed(), which
+ * takes back whatever wave_gen hasn't sent
+ */
+#define STEP_RUN_MAX 1024
+
+/*
+ * Turn a Q32.32 interval into whole ticks, carrying the fraction forwards
+ * so that the average step rate is exact
+ */
+static inline int step_source_diffuse(struct step_source *ss, uint64_t c)
 {
-	struct step_source *ss = (struct step_source *)s;
+	c += ss->residual;
+	ss->residual = (uint32_t)c;
+
+	return c >> STEP_FIXED_SHIFT;
+}
 
-	if (ss->edge == EDGE_RISING) {
+/* Step the speed-mode profile, and return the new interval in Q32.32 ticks */
+static uint64_t step_source_tick(struct step_source *ss)
+{
+	switch (ss->profile) {
+	case STEP_PROFILE_SCURVE:
+		scurve_tick(&ss->scctx);
+		return step_fixed_from_double(ss->scctx.c);
+	case STEP_PROFILE_TABLE:
+		stepper_table_tick(&ss->tctx);
+		return ss->tctx.c;
+	case STEP_PROFILE_FIXED:
+		stepper_fixed_tick(&ss->fctx);
+		return ss->fctx.c;
+	case STEP_PROFILE_DOUBLE:
+	default:
 		stepper_tick(&ss->sctx);
-		ss->gap = round(ss->sctx.c);
+		return step_fixed_from_double(ss->sctx.c);
+	}
+}
+
+static int step_source_get_delay_speed(struct step_source *ss)
+{
+	switch (ss->edge) {
+	case EDGE_RISING:
+		ss->pos += ss->dir;
+		ss->gap = step_source_diffuse(ss, step_source_tick(ss));
+		if (ss->dual_edge) {
+			return ss->gap;
+		}
 		ss->edge = EDGE_FALLING;
 		return ss->pulsewidth;
-	} else {
+	case EDGE_FALLING:
 		ss->edge = EDGE_RISING;
 		return ss->gap - ss->pulsewidth;
+	case EDGE_DIR:
+		ss->edge = EDGE_RISING;
+		return ss->dir_setup;
+	case EDGE_NONE:
+	default:
+		/* Not part-way through a step, so start stepping straight away */
+		if (!ss->dir) {
+			ss->dir = 1;
+			if (ss->dir_channel >= 0) {
+				ss->edge = EDGE_DIR;
+				return 1;
+			}
+		}
+		ss->edge = EDGE_RISING;
+		return 1;
+	}
+}
+
+static void step_source_pop_move(struct step_source *ss)
+{
+	struct step_move *m = &ss->moves[ss->move_head];
+	struct step_move *next;
+
+	ss->move_head = (ss->move_head + 1) % STEP_MOVE_QUEUE_LEN;
+	ss->n_moves--;
+
+	/* Carry the speed over to the next move's ramp */
+	if (ss->n_moves && ss->ramp_n) {
+		next = &ss->moves[ss->move_head];
+		ss->ramp_n = ss->ramp_n * m->ramp->accel / next->ramp->accel;
+		if (ss->ramp_n > next->n_max) {
+			ss->ramp_n = next->n_max;
+		}
+	}
+
+	step_ramp_put(m->ramp);
+}
+
+/* Work out what to do after the step at ss->pos */
+static int step_source_next(struct step_source *ss)
+{
+	struct step_move *m;
+
+	while (ss->n_moves) {
+		m = &ss->moves[ss->move_head];
+		if (m->target != ss->pos) {
+			break;
+		}
+		step_source_pop_move(ss);
+	}
+
+	if (!ss->n_moves) {
+		ss->ramp_n = 0;
+		return EDGE_NONE;
+	}
+
+	if (m->dir != ss->dir) {
+		ss->ramp_n = 0;
+		ss->dir = m->dir;
+		if (ss->dir_channel >= 0) {
+			return EDGE_DIR;
+		}
+	}
+
+	return EDGE_RISING;
+}
+
+/* The interval between the step at ss->pos and the next one */
+static int step_source_interval(struct step_source *ss)
+{
+	struct step_move *m = &ss->moves[ss->move_head];
+
+	return step_source_diffuse(ss,
+		step_ramp_interval(m->ramp, &ss->ramp_n, m->n_max, m->n_end,
+				   m->c_cruise, (m->target - ss->pos) * m->dir));
+}
+
+static int step_source_get_delay_move(struct step_source *ss)
+{
+	switch (ss->edge) {
+	case EDGE_RISING:
+		ss->pos += ss->dir;
+		ss->next = step_source_next(ss);
+		if (ss->next == EDGE_RISING) {
+			ss->gap = step_source_interval(ss);
+		}
+		if (ss->dual_edge) {
+			/* There's no falling edge, go straight to the next thing */
+			ss->edge = ss->next;
+			return ss->edge == EDGE_RISING ? ss->gap : 1;
+		}
+		ss->edge = EDGE_FALLING;
+		return ss->pulsewidth;
+	case EDGE_FALLING:
+		ss->edge = ss->next;
+		if (ss->edge == EDGE_RISING) {
+			return ss->gap - ss->pulsewidth;
+		}
+		return 1;
+	case EDGE_DIR:
+		ss->edge = EDGE_RISING;
+		return ss->dir_setup;
+	case EDGE_NONE:
+	default:
+		ss->edge = step_source_next(ss);
+		if (ss->edge == EDGE_NONE) {
+			/* Nothing to do until a move is queued */
+			ss->idle = true;
+			return SOURCE_DELAY_IDLE;
+		}
+		return 1;
 	}
 }
 
+static int step_source_get_delay(struct source *s)
+{
+	struct step_source *ss = (struct step_source *)s;
+
+	if (ss->mode == STEP_MODE_MOVE) {
+		return step_source_get_delay_move(ss);
+	}
+
+	return step_source_get_delay_speed(ss);
+}
+
 static void step_source_gen_event(struct source *s, struct event *ev)
 {
 	struct step_source *ss = (struct step_source *)s;
 
-	if (ss->edge == EDGE_RISING) {
-		ev->type = EVENT_RISING_EDGE;
+	switch (ss->edge) {
+	case EDGE_RISING:
+		ev->type = ss->dual_edge ? EVENT_TOGGLE : EVENT_RISING_EDGE;
 		ev->channel = ss->channel;
-	} else {
+		break;
+	case EDGE_FALLING:
 		ev->type = EVENT_FALLING_EDGE;
 		ev->channel = ss->channel;
+		break;
+	case EDGE_DIR:
+		ev->type = ss->dir > 0 ? EVENT_RISING_EDGE : EVENT_FALLING_EDGE;
+		ev->channel = ss->dir_channel;
+		break;
+	case EDGE_NONE:
+	default:
+		ev->type = EVENT_NONE;
+		ev->channel = ss->channel;
+		break;
+	}
+}
+
+/* The Q32.32 interval in speed mode, if it isn't going to change */
+static int step_source_steady_gap(struct step_source *ss, uint64_t *c)
+{
+	switch (ss->profile) {
+	case STEP_PROFILE_DOUBLE:
+		*c = step_fixed_from_double(ss->sctx.c);
+		return ss->sctx.steady;
+	case STEP_PROFILE_FIXED:
+		*c = ss->fctx.c;
+		return ss->fctx.steady;
+	case STEP_PROFILE_TABLE:
+		*c = ss->tctx.c;
+		return ss->tctx.steady;
+	case STEP_PROFILE_SCURVE:
+		*c = step_fixed_from_double(ss->scctx.c);
+		return ss->scctx.steady && ss->scctx.v > 0;
+	}
+
+	return 0;
+}
+
+/*
+ * How many of the upcoming steps will be followed by the same Q32.32
+ * interval, which is returned in *c. Only counts from the start of a step.
+ */
+static uint32_t step_source_run_len(struct step_source *ss, uint64_t *c)
+{
+	struct step_move *m = &ss->moves[ss->move_head];
+	int32_t remaining;
+	uint32_t count;
+
+	if (ss->edge != EDGE_RISING) {
+		return 0;
+	}
+
+	if (ss->mode == STEP_MODE_SPEED) {
+		if (!step_source_steady_gap(ss, c)) {
+			return 0;
+		}
+		count = STEP_RUN_MAX;
+	} else {
+		if (!ss->n_moves || m->dir != ss->dir || ss->ramp_n != m->n_max) {
+			return 0;
+		}
+
+		/* Cruise until it's time to decelerate, see step_ramp_interval() */
+		remaining = (m->target - ss->pos) * m->dir;
+		if (remaining - 1 <= m->n_max - m->n_end) {
+			return 0;
+		}
+		count = remaining - 1 - (m->n_max - m->n_end);
+		*c = m->c_cruise;
+		if (count > STEP_RUN_MAX) {
+			count = STEP_RUN_MAX;
+		}
 	}
+
+	return count;
+}
+
+static int step_source_get_run(struct source *s, struct step_run *run)
+{
+	struct step_source *ss = (struct step_source *)s;
+	uint64_t c;
+	uint32_t count = step_source_run_len(ss, &c);
+
+	if (!count) {
+		return 0;
+	}
+
+	run->channel = ss->channel;
+	run->pulsewidth = ss->dual_edge ? 0 : ss->pulsewidth;
+	run->count = count;
+	run->interval = c >> STEP_FIXED_SHIFT;
+	run->add = 0;
+	/* The run carries on the error diffusion from step_source_diffuse() */
+	run->frac = (uint32_t)c;
+	run->residual = ss->residual;
+
+	ss->residual += count * (uint32_t)c;
+	ss->pos += count * ss->dir;
+
+	return 1;
+}
+
+static int step_source_fill(struct source *s, struct timed_event *buf,
+			    int max, int horizon)
+{
+	struct step_source *ss = (struct step_source *)s;
+	int n = 0, t = 0;
+	uint64_t c;
+
+	/* Stop early if a run can take over */
+	do {
+		step_source_gen_event(s, &buf[n].ev);
+		buf[n].delay = step_source_get_delay(s);
+		if (buf[n].delay == SOURCE_DELAY_IDLE) {
+			return n + 1;
+		}
+
+		t += buf[n].delay;
+		n++;
+	} while (n < max && t < horizon && !step_source_run_len(ss, &c));
+
+	return n;
 }
 
 struct step_source *step_source_create(int channel)
 {
 	struct step_source *ss = calloc(1, sizeof(*ss));
+	if (!ss) {
+		return NULL;
+	}
 
 	ss->base.gen_event = step_source_gen_event;
 	ss->base.get_delay = step_source_get_delay;
+	ss->base.get_run = step_source_get_run;
 	ss->pulsewidth = 5;
 	ss->channel = channel;
+	/* Start half way, so the first interval is rounded to nearest */
+	ss->residual = 1U << (STEP_FIXED_SHIFT - 1);
+	ss->dir_channel = -1;
+	ss->dir_setup = 1;
+	ss->mode = STEP_MODE_MOVE;
+	ss->edge = EDGE_NONE;
+	ss->next = EDGE_NONE;
 
-	step_ctx_init(&ss->sctx, 600, 100000, 100);
+	step_ctx_init(&ss->sctx, STEPS_PER_REV, TIMER_FREQ, ACCEL);
+	step_ctx_fixed_init(&ss->fctx, STEPS_PER_REV, TIMER_FREQ, ACCEL);
+	scurve_ctx_init(&ss->scctx, STEPS_PER_REV, TIMER_FREQ, ACCEL, JERK);
+	if (step_ctx_table_init(&ss->tctx, STEPS_PER_REV, TIMER_FREQ, ACCEL)) {
+		free(ss);
+		return NULL;
+	}
+	ss->profile = STEP_PROFILE_TABLE;
 
 	return ss;
 }
 
-void step_source_set_speed(struct source *s, double speed)
+static void step_source_flush_moves(struct step_source *ss)
+{
+	while (ss->n_moves) {
+		step_source_pop_move(ss);
+	}
+	ss->queued_pos = ss->pos;
+}
+
+void step_source_destroy(struct step_source *ss)
+{
+	step_source_flush_moves(ss);
+	step_ctx_table_fini(&ss->tctx);
+	free(ss);
+}
+
+/*
+ * Take back the steps of the current run which wave_gen hasn't started, so
+ * that a new speed or move takes effect from the next step
+ */
+static void step_source_cancel_run(struct step_source *ss)
+{
+	struct step_run rest;
+
+	if (!ss->base.ctx || !wave_ctx_cancel_run(ss->base.ctx, &ss->base, &rest)) {
+		return;
+	}
+
+	ss->pos -= (int32_t)rest.count * ss->dir;
+	ss->residual = rest.residual;
+}
+
+/* Have wave_gen ask for events again, if the source went idle */
+static void step_source_wake(struct step_source *ss)
+{
+	if (ss->idle && ss->base.ctx) {
+		wave_ctx_wake_source(ss->base.ctx, &ss->base);
+		ss->idle = false;
+	}
+}
+
+/* How fast the speed-mode profile is stepping, in rad/s */
+static double step_source_speed_now(struct step_source *ss)
+{
+	double c;
+
+	if (ss->edge != EDGE_RISING && ss->edge != EDGE_FALLING) {
+		return 0;
+	}
+
+	switch (ss->profile) {
+	case STEP_PROFILE_SCURVE:
+		if (ss->scctx.v <= 0) {
+			return 0;
+		}
+		c = ss->scctx.c;
+		break;
+	case STEP_PROFILE_TABLE:
+		if (!ss->tctx.n) {
+			return 0;
+		}
+		c = (double)ss->tctx.c / (1ULL << STEP_FIXED_SHIFT);
+		break;
+	case STEP_PROFILE_FIXED:
+		if (!ss->fctx.n) {
+			return 0;
+		}
+		c = (double)ss->fctx.c / (1ULL << STEP_FIXED_SHIFT);
+		break;
+	case STEP_PROFILE_DOUBLE:
+	default:
+		if (ss->sctx.n == 0.0f) {
+			return 0;
+		}
+		c = ss->sctx.c;
+		break;
+	}
+
+	return (ss->sctx.alpha * ss->sctx.f) / c;
+}
+
+/* How fast the current move is stepping, in rad/s */
+static double step_source_move_speed(struct step_source *ss)
+{
+	struct step_move *m = &ss->moves[ss->move_head];
+
+	if (!ss->n_moves || !ss->ramp_n || ss->edge == EDGE_NONE) {
+		return 0;
+	}
+
+	if (ss->ramp_n == m->n_max) {
+		return (ss->sctx.alpha * ss->sctx.f * (1ULL << STEP_FIXED_SHIFT)) /
+		       m->c_cruise;
+	}
+
+	return sqrt(2 * ss->sctx.alpha * m->ramp->accel * ss->ramp_n);
+}
+
+/*
+ * Put all of the speed-mode profiles at a speed in rad/s, so that
+ * set_speed() ramps from there instead of from wherever they were left
+ */
+static int step_source_seed_speed(struct step_source *ss, double speed)
+{
+	double alpha = ss->sctx.alpha;
+	double n = 0, c = 0;
+	int32_t n_int = 0;
+
+	if (speed > 0) {
+		n = (speed * speed) / (2 * alpha * ACCEL);
+		c = (alpha * ss->sctx.f) / speed;
+		n_int = n < 1 ? 1 : n;
+		if (step_ramp_reserve(ss->tctx.ramp, n_int + 1)) {
+			return -1;
+		}
+	}
+
+	ss->sctx.n = n;
+	ss->sctx.c = c;
+	ss->fctx.n = n_int;
+	ss->fctx.c = step_fixed_from_double(c);
+	ss->tctx.n = n_int;
+	ss->tctx.c = step_fixed_from_double(c);
+	ss->scctx.v = speed > 0 ? 1 / c : 0;
+	ss->scctx.a = 0;
+	ss->scctx.c = c;
+
+	return 0;
+}
+
+int step_source_set_speed(struct source *s, double speed)
 {
 	struct step_source *ss = (struct step_source *)s;
 
+	step_source_cancel_run(ss);
+	if (ss->mode == STEP_MODE_MOVE) {
+		/* Pick up from the speed that the moves had got to */
+		if (step_source_seed_speed(ss, step_source_move_speed(ss))) {
+			return -1;
+		}
+		if (ss->edge == EDGE_FALLING && ss->next == EDGE_DIR) {
+			/* The pin hasn't changed yet, so carry on the old way */
+			ss->dir = -ss->dir;
+		}
+	}
+
+	if (stepper_table_set_speed(&ss->tctx, speed)) {
+		return -1;
+	}
 	stepper_set_speed(&ss->sctx, speed);
+	stepper_fixed_set_speed(&ss->fctx, speed);
+	scurve_set_speed(&ss->scctx, speed);
+
+	step_source_flush_moves(ss);
+	ss->mode = STEP_MODE_SPEED;
+	step_source_wake(ss);
+
+	return 0;
+}
+
+void step_source_set_profile(struct source *s, enum step_profile profile)
+{
+	struct step_source *ss = (struct step_source *)s;
+
+	ss->profile = profile;
+}
+
+int step_source_queue_move(struct source *s, int32_t target, double speed,
+			   double accel)
+{
+	struct step_source *ss = (struct step_source *)s;
+	struct step_move *m, *prev;
+	double alpha = ss->sctx.alpha;
+	int32_t n_end, n_stop;
+	double v;
+
+	if (speed <= 0 || accel <= 0 || ss->n_moves == STEP_MOVE_QUEUE_LEN) {
+		return -1;
+	}
+
+	if (ss->mode == STEP_MODE_SPEED) {
+		step_source_cancel_run(ss);
+		v = step_source_speed_now(ss);
+		ss->mode = STEP_MODE_MOVE;
+		ss->next = EDGE_NONE;
+		ss->ramp_n = 0;
+		ss->queued_pos = ss->pos;
+		if (v > 0) {
+			/*
+			 * Rather than stopping dead, carry on to where it could
+			 * stop at this acceleration. The new move then follows
+			 * on from that like any other.
+			 */
+			n_stop = (v * v) / (2 * alpha * accel);
+			if (step_source_queue_move(s, ss->pos + ss->dir * (n_stop + 1),
+						   v, accel)) {
+				ss->mode = STEP_MODE_SPEED;
+				return -1;
+			}
+			ss->ramp_n = ss->moves[ss->move_head].n_max;
+			if (ss->edge == EDGE_FALLING) {
+				ss->next = step_source_next(ss);
+			}
+		} else {
+			/* Finish the current pulse, if there is one, then wait for moves */
+			if (ss->edge == EDGE_DIR) {
+				/* The pin never got set */
+				ss->dir = 0;
+			}
+			if (ss->edge != EDGE_FALLING) {
+				ss->edge = EDGE_NONE;
+			}
+		}
+	}
+
+	if (target == ss->queued_pos) {
+		return 0;
+	}
+
+	m = &ss->moves[(ss->move_head + ss->n_moves) % STEP_MOVE_QUEUE_LEN];
+	m->ramp = step_ramp_get(STEPS_PER_REV, TIMER_FREQ, accel);
+	if (!m->ramp) {
+		return -1;
+	}
+
+	m->target = target;
+	m->dir = target > ss->queued_pos ? 1 : -1;
+	m->n_max = (speed * speed) / (2 * alpha * accel);
+	m->n_end = 0;
+	m->c_cruise = step_fixed_from_double((alpha * ss->sctx.f) / speed);
+
+	if (step_ramp_reserve(m->ramp, m->n_max + 1)) {
+		step_ramp_put(m->ramp);
+		return -1;
+	}
+
+	/*
+	 * Let the previous move finish at whatever speed this one can reach,
+	 * and still stop in time at its own target
+	 */
+	if (ss->n_moves) {
+		prev = &ss->moves[(ss->move_head + ss->n_moves - 1) % STEP_MOVE_QUEUE_LEN];
+		if (prev->dir == m->dir) {
+			n_end = abs(target - prev->target);
+			if (n_end > m->n_max) {
+				n_end = m->n_max;
+			}
+			n_end = n_end * accel / prev->ramp->accel;
+			prev->n_end = n_end < prev->n_max ? n_end : prev->n_max;
+		}
+	}
+
+	ss->n_moves++;
+	ss->queued_pos = target;
+	step_source_wake(ss);
+
+	return 0;
+}
+
+void step_source_set_dir_channel(struct source *s, int channel, int setup_ticks)
+{
+	struct step_source *ss = (struct step_source *)s;
+
+	ss->dir_channel = channel;
+	ss->dir_setup = setup_ticks;
+}
+
+int32_t step_source_get_position(struct source *s)
+{
+	struct step_source *ss = (struct step_source *)s;
+	int32_t pending = 0;
+
+	/* Steps in a run which haven't been sent don't count yet */
+	if (ss->base.ctx) {
+		pending = wave_ctx_run_pending(ss->base.ctx, &ss->base);
+	}
+
+	return ss->pos - (pending * ss->dir);
+}
+
+void step_source_set_dual_edge(struct source *s, bool dual_edge)
+{
+	struct step_source *ss = (struct step_source *)s;
+
+	ss->dual_edge = dual_edge;
+}
+
+void step_source_set_fill(struct source *s, bool fill)
+{
+	s->fill = fill ? step_source_fill : NULL;
 }
@@ -17,26 +17,140 @@
  */
 #ifndef __STEP_SOURCE_H__
 #define __STEP_SOURCE_H__
+#include <stdbool.h>
 
 #include "wave_gen.h"
 #include "step_gen.h"
+#include "scurve_gen.h"
 
 enum edge {
 	EDGE_RISING,
 	EDGE_FALLING,
+	/* Set the direction pin */
+	EDGE_DIR,
+	/* Idle, waiting for a move */
+	EDGE_NONE,
+};
+
+enum step_mode {
+	/* Run at the speed given to step_source_set_speed() */
+	STEP_MODE_SPEED,
+	/* Run the moves given to step_source_queue_move() */
+	STEP_MODE_MOVE,
+};
+
+#define STEP_MOVE_QUEUE_LEN 16
+
+struct step_move {
+	/* Absolute position at the end of the move */
+	int32_t target;
+	/* +1 or -1 */
+	int dir;
+
+	struct step_ramp *ramp;
+	/* Ramp index at max speed */
+	int32_t n_max;
+	/* Ramp index to finish at, so the next move can carry on without stopping */
+	int32_t n_end;
+	/* Interval at max speed, Q32.32 ticks */
+	uint64_t c_cruise;
+};
+
+enum step_profile {
+	/* Double-precision step_ctx */
+	STEP_PROFILE_DOUBLE,
+	/* Q32.32 fixed-point step_ctx_fixed */
+	STEP_PROFILE_FIXED,
+	/* step_ctx_table, using a ramp shared with other sources */
+	STEP_PROFILE_TABLE,
+	/* Jerk-limited scurve_ctx */
+	STEP_PROFILE_SCURVE,
 };
 
 struct step_source {
 	struct source base;
+	enum step_profile profile;
 	struct step_ctx sctx;
+	struct step_ctx_fixed fctx;
+	struct step_ctx_table tctx;
+	struct scurve_ctx scctx;
 
 	int edge;
 	int gap;
 	int pulsewidth;
 	int channel;
+	/* Step on both edges: toggle the pin once per step, with no pulse */
+	bool dual_edge;
+
+	/*
+	 * The fraction of a tick which rounding the interval down lost,
+	 * carried over to the next interval (Q0.32)
+	 */
+	uint32_t residual;
+
+	enum step_mode mode;
+
+	/* Direction pin, or -1 if there isn't one */
+	int dir_channel;
+	/* Ticks between changing the direction pin and the next step */
+	int dir_setup;
+
+	/* Current position, and direction of the last step */
+	int32_t pos;
+	int dir;
+	/* Index in the current move's ramp */
+	int32_t ramp_n;
+	/* What to do after the current step's falling edge */
+	int next;
+	/* Returned SOURCE_DELAY_IDLE, so wave_gen needs waking for new moves */
+	bool idle;
+
+	/* Ring of moves. moves[move_head] is the one in progress */
+	struct step_move moves[STEP_MOVE_QUEUE_LEN];
+	int move_head;
+	int n_moves;
+	/* Position at the end of the last queued move */
+	int32_t queued_pos;
 };
 
 struct step_source *step_source_create(int channel);
-void step_source_set_speed(struct source *s, double speed);
+void step_source_destroy(struct step_source *ss);
+/*
+ * Run continuously at a speed in rad/s, ramping from however fast the source
+ * is already going. Carries on in the direction of the last move, or
+ * positive if there wasn't one.
+ */
+int step_source_set_speed(struct source *s, double speed);
+/* Must be called before the source generates its first step */
+void step_source_set_profile(struct source *s, enum step_profile profile);
+
+/*
+ * Queue a trapezoidal move to an absolute position, with a max speed in
+ * rad/s and an acceleration in rad/s^2. The source decelerates so that it
+ * stops exactly on target, unless the next queued move carries on in the
+ * same direction, in which case it only slows down as much as that move
+ * needs.
+ *
+ * In speed mode, the source first carries on to where it could stop at the
+ * new acceleration, and the move follows on from there.
+ *
+ * Returns -1 if the queue is full or the parameters are invalid.
+ */
+int step_source_queue_move(struct source *s, int32_t target, double speed,
+			   double accel);
+/* Drive a direction pin, which is high for positive moves */
+void step_source_set_dir_channel(struct source *s, int channel, int setup_ticks);
+int32_t step_source_get_position(struct source *s);
+/*
+ * For drivers which step on both edges. Must be called before the source
+ * generates its first step
+ */
+void step_source_set_dual_edge(struct source *s, bool dual_edge);
+/*
+ * Generate steps with fill() instead of one at a time. Off by default, as
+ * it's no faster than single events for steps. Must be called before the
+ * source is added to a wave_ctx
+ */
+void step_source_set_fill(struct source *s, bool fill);
 
 #endif /* __STEP_SOURCE_H__ */
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tee_backend.h"
+#include "types.h"
+
+static void tee_backend_push(struct tee_backend *tb, uint64_t time,
+			     uint32_t set, uint32_t clear)
+{
+	uint32_t head = tb->head;
+	uint32_t tail = __atomic_load_n(&tb->tail, __ATOMIC_ACQUIRE);
+	struct tee_record *rec;
+
+	if (head - tail > tb->ring_mask) {
+		tb->dropped++;
+		return;
+	}
+
+	rec = &tb->ring[head & tb->ring_mask];
+	rec->time = time;
+	rec->set = set;
+	rec->clear = clear;
+
+	__atomic_store_n(&tb->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void tee_backend_emit_event(struct wave_backend *wb, const struct event *ev)
+{
+	struct tee_backend *tb = (struct tee_backend *)wb;
+	uint32_t bit;
+
+	switch (ev->type) {
+	case EVENT_RISING_EDGE:
+		tb->rising |= (1 << ev->channel);
+		break;
+	case EVENT_FALLING_EDGE:
+		tb->falling |= (1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		tb->rising |= ev->rising;
+		tb->falling |= ev->falling;
+		break;
+	case EVENT_TOGGLE:
+		bit = 1 << ev->channel;
+		if (((tb->level | tb->rising) & ~tb->falling) & bit) {
+			tb->rising &= ~bit;
+			tb->falling |= bit;
+		} else {
+			tb->falling &= ~bit;
+			tb->rising |= bit;
+		}
+		break;
+	case EVENT_NONE:
+		break;
+	}
+
+	tb->primary->emit_event(tb->primary, ev);
+}
+
+static void tee_backend_add_event(struct wave_backend *wb, struct source *s)
+{
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	tee_backend_emit_event(wb, &ev);
+}
+
+static void tee_backend_add_delay(struct wave_backend *wb, int delay)
+{
+	struct tee_backend *tb = (struct tee_backend *)wb;
+
+	tb->primary->add_delay(tb->primary, delay);
+
+	if (tb->rising | tb->falling) {
+		tee_backend_push(tb, tb->time, tb->rising, tb->falling);
+	}
+
+	tb->level = (tb->level | tb->rising) & ~tb->falling;
+	tb->rising = tb->falling = 0;
+	tb->time += delay;
+}
+
+/* Only used if primary has add_run(). The steps it took are recorded here */
+static int tee_backend_add_run(struct wave_backend *wb, struct step_run *run, int limit)
+{
+	struct tee_backend *tb = (struct tee_backend *)wb;
+	uint32_t bit = 1 << run->channel;
+	struct step_run r = *run;
+	uint64_t t = tb->time;
+	int ticks;
+
+	ticks = tb->primary->add_run(tb->primary, run, limit);
+
+	while (r.count > run->count) {
+		if (r.pulsewidth) {
+			tee_backend_push(tb, t, bit, 0);
+			tee_backend_push(tb, t + r.pulsewidth, 0, bit);
+			tb->level &= ~bit;
+		} else {
+			tb->level ^= bit;
+			tee_backend_push(tb, t, tb->level & bit, ~tb->level & bit);
+		}
+
+		t += step_run_interval(&r);
+		step_run_advance(&r);
+	}
+	tb->time += ticks < limit ? ticks : limit;
+
+	return ticks;
+}
+
+/* Only used if primary has full() */
+static bool tee_backend_full(struct wave_backend *wb)
+{
+	struct tee_backend *tb = (struct tee_backend *)wb;
+
+	return tb->primary->full(tb->primary);
+}
+
+static void tee_backend_start_wave(struct wave_backend *wb)
+{
+	struct tee_backend *tb = (struct tee_backend *)wb;
+
+	if (tb->primary->start_wave) {
+		tb->primary->start_wave(tb->primary);
+	}
+}
+
+static void tee_backend_end_wave(struct wave_backend *wb)
+{
+	struct tee_backend *tb = (struct tee_backend *)wb;
+
+	if (tb->primary->end_wave) {
+		tb->primary->end_wave(tb->primary);
+	}
+}
+
+/* Move secondary on to time, finishing the slot it was in */
+static void tee_drain_to(struct tee_backend *tb, uint64_t time)
+{
+	struct wave_backend *be = tb->secondary;
+	uint64_t delta = time - tb->drain_time;
+
+	while (delta > INT_MAX) {
+		be->add_delay(be, INT_MAX);
+		delta -= INT_MAX;
+	}
+	if (delta) {
+		be->add_delay(be, delta);
+	}
+
+	tb->drain_time = time;
+}
+
+static void *tee_drain_thread(void *arg)
+{
+	struct tee_backend *tb = arg;
+	struct wave_backend *be = tb->secondary;
+	struct event ev = { .type = EVENT_EDGES };
+	uint32_t head, tail = tb->tail;
+	bool drained = false;
+
+	/*
+	 * Best effort: give way to the generator, but still get a share of the
+	 * CPU when it's busy. SCHED_IDLE would starve the drain on one core.
+	 */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), TEE_DRAIN_NICE);
+
+	while (1) {
+		int stop = __atomic_load_n(&tb->stop, __ATOMIC_ACQUIRE);
+
+		head = __atomic_load_n(&tb->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (stop) {
+				break;
+			}
+
+			/* Let the output catch up before going idle */
+			if (drained && be->end_wave) {
+				be->end_wave(be);
+			}
+			drained = false;
+			usleep(TEE_POLL_US);
+			continue;
+		}
+
+		if (!drained && be->start_wave) {
+			be->start_wave(be);
+		}
+
+		for (; tail != head; tail++) {
+			struct tee_record *rec = &tb->ring[tail & tb->ring_mask];
+
+			tee_drain_to(tb, rec->time);
+			ev.rising = rec->set;
+			ev.falling = rec->clear;
+			be->emit_event(be, &ev);
+		}
+		__atomic_store_n(&tb->tail, tail, __ATOMIC_RELEASE);
+		drained = true;
+	}
+
+	/* Finish the last slot */
+	tee_drain_to(tb, tb->drain_time + 1);
+	if (be->end_wave) {
+		be->end_wave(be);
+	}
+
+	return NULL;
+}
+
+void tee_backend_fini(struct tee_backend *tb)
+{
+	if (tb->ring) {
+		__atomic_store_n(&tb->stop, 1, __ATOMIC_RELEASE);
+		pthread_join(tb->thread, NULL);
+		free(tb->ring);
+	}
+
+	if (tb->dropped) {
+		fprintf(stderr, "tee: %llu slots dropped from the recording\n",
+			(unsigned long long)tb->dropped);
+	}
+
+	free(tb);
+}
+
+struct tee_backend *tee_backend_create(struct wave_backend *primary,
+				       struct wave_backend *secondary,
+				       uint32_t ring_len)
+{
+	struct tee_backend *tb;
+
+	if (!ring_len || (ring_len & (ring_len - 1))) {
+		return NULL;
+	}
+
+	tb = calloc(1, sizeof(*tb));
+	if (!tb) {
+		return NULL;
+	}
+
+	tb->primary = primary;
+	tb->secondary = secondary;
+	tb->ring_mask = ring_len - 1;
+
+	tb->base.start_wave = tee_backend_start_wave;
+	tb->base.add_delay = tee_backend_add_delay;
+	tb->base.add_event = tee_backend_add_event;
+	tb->base.emit_event = tee_backend_emit_event;
+	if (primary->add_run) {
+		tb->base.add_run = tee_backend_add_run;
+	}
+	if (primary->full) {
+		tb->base.full = tee_backend_full;
+	}
+	tb->base.end_wave = tee_backend_end_wave;
+
+	tb->ring = calloc(ring_len, sizeof(*tb->ring));
+	if (!tb->ring) {
+		goto fail;
+	}
+
+	if (pthread_create(&tb->thread, NULL, tee_drain_thread, tb)) {
+		fprintf(stderr, "tee: Couldn't start drain thread\n");
+		free(tb->ring);
+		tb->ring = NULL;
+		goto fail;
+	}
+
+	return tb;
+
+fail:
+	tee_backend_fini(tb);
+	return NULL;
+}
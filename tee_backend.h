@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __TEE_BACKEND_H__
+#define __TEE_BACKEND_H__
+#include <pthread.h>
+#include <stdint.h>
+
+#include "wave_gen.h"
+
+#define TEE_RING_LEN (64 * 1024)
+/* How long the drain thread sleeps when the ring is empty */
+#define TEE_POLL_US 1000
+/* Nice value for the drain thread */
+#define TEE_DRAIN_NICE 10
+
+/* One slot which had edges, at an absolute tick */
+struct tee_record {
+	uint64_t time;
+	uint32_t set;
+	uint32_t clear;
+};
+
+/*
+ * Passes everything straight through to primary, and also records each slot
+ * into a single-producer, single-consumer ring. A low-priority thread drains
+ * the ring into secondary. If the ring is full, slots are dropped from the
+ * secondary's output, and primary never waits.
+ *
+ * primary and secondary still belong to the caller, and secondary mustn't be
+ * touched by anything else until tee_backend_fini().
+ */
+struct tee_backend {
+	struct wave_backend base;
+	struct wave_backend *primary;
+	struct wave_backend *secondary;
+
+	uint64_t time;
+	uint32_t rising;
+	uint32_t falling;
+	/* Pin levels at the end of the last slot, for EVENT_TOGGLE */
+	uint32_t level;
+	/* Slots which didn't fit in the ring */
+	uint64_t dropped;
+
+	struct tee_record *ring;
+	uint32_t ring_mask;
+	/* Only written by the producer */
+	uint32_t head __attribute__((aligned(64)));
+	/* Only written by the drain thread */
+	uint32_t tail __attribute__((aligned(64)));
+	int stop;
+
+	pthread_t thread;
+	/* Drain thread's position in secondary */
+	uint64_t drain_time;
+};
+
+/* ring_len must be a power of two */
+struct tee_backend *tee_backend_create(struct wave_backend *primary,
+				       struct wave_backend *secondary,
+				       uint32_t ring_len);
+void tee_backend_fini(struct tee_backend *tb);
+
+#endif /* __TEE_BACKEND_H__ */
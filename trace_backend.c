@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "trace_backend.h"
+#include "types.h"
+
+static void trace_backend_emit_event(struct wave_backend *wb, const struct event *ev)
+{
+	struct trace_backend *be = (struct trace_backend *)wb;
+	uint32_t bit;
+
+	switch (ev->type) {
+	case EVENT_RISING_EDGE:
+		be->rising |= (1 << ev->channel);
+		break;
+	case EVENT_FALLING_EDGE:
+		be->falling |= (1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		be->rising |= ev->rising;
+		be->falling |= ev->falling;
+		break;
+	case EVENT_TOGGLE:
+		bit = 1 << ev->channel;
+		if (((be->level | be->rising) & ~be->falling) & bit) {
+			be->rising &= ~bit;
+			be->falling |= bit;
+		} else {
+			be->falling &= ~bit;
+			be->rising |= bit;
+		}
+		break;
+	case EVENT_NONE:
+		break;
+	}
+}
+
+static void trace_backend_add_event(struct wave_backend *wb, struct source *s)
+{
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	trace_backend_emit_event(wb, &ev);
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+
+	return p + 4;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Make sure there's room for another record, growing the file if not */
+static int trace_backend_reserve(struct trace_backend *be)
+{
+	size_t size = be->size + TRACE_GROW;
+	uint8_t *map;
+
+	if (be->len + TRACE_RECORD_MAX <= be->size) {
+		return 0;
+	}
+
+	if (ftruncate(be->fd, size)) {
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, be->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	if (be->map) {
+		munmap(be->map, be->size);
+	}
+	be->map = map;
+	be->size = size;
+
+	return 0;
+}
+
+static void trace_backend_add_delay(struct wave_backend *wb, int delay)
+{
+	struct trace_backend *be = (struct trace_backend *)wb;
+	uint32_t rising = be->rising & be->pins;
+	uint32_t falling = be->falling & be->pins;
+	uint64_t delta;
+	uint8_t *p;
+
+	/* Slots with no edges are folded into the next record's delta */
+	if ((rising | falling) && !be->full) {
+		if (trace_backend_reserve(be)) {
+			fprintf(stderr, "Trace file full at %zu bytes\n", be->len);
+			be->full = true;
+			goto out;
+		}
+
+		p = be->map + be->len;
+		delta = be->time - be->last;
+		while (delta >= 0x80) {
+			*p++ = delta | 0x80;
+			delta >>= 7;
+		}
+		*p++ = delta;
+		p = put_le32(p, rising);
+		p = put_le32(p, falling);
+
+		be->len = p - be->map;
+		be->last = be->time;
+	}
+
+out:
+	be->level = (be->level | be->rising) & ~be->falling;
+	be->rising = be->falling = 0;
+	be->time += delay;
+}
+
+size_t trace_decode(const uint8_t *buf, size_t len, uint64_t *delta,
+		    uint32_t *set, uint32_t *clear)
+{
+	size_t n = 0;
+	int shift = 0;
+
+	*delta = 0;
+	do {
+		if (n >= len || shift > 63) {
+			return 0;
+		}
+		*delta |= (uint64_t)(buf[n] & 0x7f) << shift;
+		shift += 7;
+	} while (buf[n++] & 0x80);
+
+	if (n + 8 > len) {
+		return 0;
+	}
+
+	*set = get_le32(buf + n);
+	*clear = get_le32(buf + n + 4);
+	if (!(*set | *clear)) {
+		return 0;
+	}
+
+	return n + 8;
+}
+
+void trace_backend_fini(struct trace_backend *be)
+{
+	if (be->map) {
+		munmap(be->map, be->size);
+	}
+	if (be->fd >= 0) {
+		/* Trim off the unused part of the last TRACE_GROW */
+		if (ftruncate(be->fd, be->len)) {
+			fprintf(stderr, "Couldn't truncate trace file\n");
+		}
+		close(be->fd);
+	}
+	free(be);
+}
+
+struct trace_backend *trace_backend_create(uint32_t pins, const char *path)
+{
+	struct trace_backend *be = calloc(1, sizeof(*be));
+	uint8_t *p;
+
+	if (!be) {
+		return NULL;
+	}
+
+	be->pins = pins;
+	be->base.add_delay = trace_backend_add_delay;
+	be->base.add_event = trace_backend_add_event;
+	be->base.emit_event = trace_backend_emit_event;
+
+	be->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (be->fd < 0) {
+		perror("Opening trace file");
+		goto fail;
+	}
+
+	if (trace_backend_reserve(be)) {
+		perror("Mapping trace file");
+		goto fail;
+	}
+
+	p = be->map;
+	memcpy(p, TRACE_MAGIC, 4);
+	p = put_le32(p + 4, TRACE_VERSION);
+	p = put_le32(p, pins);
+	p = put_le32(p, 0);
+	be->len = p - be->map;
+
+	return be;
+
+fail:
+	trace_backend_fini(be);
+	return NULL;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef __TRACE_BACKEND_H__
+#define __TRACE_BACKEND_H__
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wave_gen.h"
+
+/*
+ * Trace file format. All multi-byte fields are little-endian.
+ *
+ * A struct trace_header, then one record for every slot which had any edges:
+ *
+ *   delta  Ticks since the previous record (or since time 0), as an
+ *          unsigned LEB128 varint
+ *   set    uint32_t mask of pins which went high
+ *   clear  uint32_t mask of pins which went low
+ *
+ * A record with set and clear both zero marks the end of the trace. The file
+ * grows in TRACE_GROW steps, so a trace which wasn't closed cleanly just
+ * ends in zeroes.
+ */
+#define TRACE_MAGIC "YPTR"
+#define TRACE_VERSION 1
+#define TRACE_GROW (16 * 1024 * 1024)
+/* 10 bytes for a 64-bit varint, and the two masks */
+#define TRACE_RECORD_MAX (10 + 4 + 4)
+
+struct trace_header {
+	char magic[4];
+	uint32_t version;
+	/* Pins which were being traced */
+	uint32_t pins;
+	uint32_t reserved;
+};
+
+struct trace_backend {
+	struct wave_backend base;
+
+	int fd;
+	uint8_t *map;
+	size_t size;
+	size_t len;
+	/* Set if the file couldn't be grown, after which nothing more is recorded */
+	bool full;
+
+	uint64_t time;
+	/* Time of the last record */
+	uint64_t last;
+
+	uint32_t pins;
+	uint32_t rising;
+	uint32_t falling;
+	/* Pin levels at the end of the last slot, for EVENT_TOGGLE */
+	uint32_t level;
+};
+
+struct trace_backend *trace_backend_create(uint32_t pins, const char *path);
+void trace_backend_fini(struct trace_backend *be);
+
+/* Decode one record from buf, returning its length or 0 if it's the end */
+size_t trace_decode(const uint8_t *buf, size_t len, uint64_t *delta,
+		    uint32_t *set, uint32_t *clear);
+
+#endif /* __TRACE_BACKEND_H__ */
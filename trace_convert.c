@@ -0,0 +1,154 @@
+/*
+ * trace_convert.c Convert yapidh binary traces to VCD or gnuplot data
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gnuplot_backend.h"
+#include "trace_backend.h"
+#include "types.h"
+#include "vcd_backend.h"
+
+static void replay_delay(struct wave_backend *be, uint64_t delta)
+{
+	while (delta > INT_MAX) {
+		be->add_delay(be, INT_MAX);
+		delta -= INT_MAX;
+	}
+	if (delta) {
+		be->add_delay(be, delta);
+	}
+}
+
+/* Feed every record in the trace to be, as one EVENT_EDGES per slot */
+static void replay(const uint8_t *buf, size_t len, struct wave_backend *be)
+{
+	struct event ev = { .type = EVENT_EDGES };
+	uint64_t delta;
+	size_t n;
+
+	if (be->start_wave) {
+		be->start_wave(be);
+	}
+
+	while ((n = trace_decode(buf, len, &delta, &ev.rising, &ev.falling))) {
+		replay_delay(be, delta);
+		be->emit_event(be, &ev);
+
+		buf += n;
+		len -= n;
+	}
+	be->add_delay(be, 1);
+
+	if (be->end_wave) {
+		be->end_wave(be);
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-g] [-w ticks] trace_file\n", prog);
+	fprintf(stderr, "Writes the trace to stdout as VCD\n");
+	fprintf(stderr, "  -g    Write gnuplot data instead\n");
+	fprintf(stderr, "  -w N  With -g, write the min/max envelope of each N-tick window\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const struct trace_header *hdr;
+	struct gnuplot_backend *gb = NULL;
+	struct vcd_backend *vb = NULL;
+	bool gnuplot = false;
+	struct stat st;
+	uint8_t *map;
+	int fd, opt, window = 0, ret = 1;
+
+	while ((opt = getopt(argc, argv, "gw:h")) != -1) {
+		switch (opt) {
+		case 'g':
+			gnuplot = true;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	if (st.st_size < (off_t)sizeof(*hdr)) {
+		fprintf(stderr, "%s: Too short to be a trace\n", argv[optind]);
+		goto fail_close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto fail_close;
+	}
+
+	hdr = (const struct trace_header *)map;
+	if (memcmp(hdr->magic, TRACE_MAGIC, 4) || hdr->version != TRACE_VERSION) {
+		fprintf(stderr, "%s: Not a version %d trace\n", argv[optind], TRACE_VERSION);
+		goto fail_unmap;
+	}
+
+	if (gnuplot) {
+		gb = gnuplot_backend_create(hdr->pins, stdout, window);
+		if (!gb) {
+			goto fail_unmap;
+		}
+		replay(map + sizeof(*hdr), st.st_size - sizeof(*hdr), &gb->base);
+		gnuplot_backend_fini(gb);
+	} else {
+		vb = vcd_backend_create(hdr->pins, stdout);
+		if (!vb) {
+			goto fail_unmap;
+		}
+		replay(map + sizeof(*hdr), st.st_size - sizeof(*hdr), &vb->base);
+		vcd_backend_fini(vb);
+	}
+
+	ret = 0;
+
+fail_unmap:
+	munmap(map, st.st_size);
+fail_close:
+	close(fd);
+
+	return ret;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2018 Brian Starkey <stark3y@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "platform.h"
+#include "trace_backend.h"
+
+#define TRACE_DEFAULT_PATH "yapidh.trace"
+
+struct platform {
+	struct trace_backend *be;
+};
+
+void platform_fini(struct platform *p)
+{
+	if (p->be) {
+		trace_backend_fini(p->be);
+	}
+	free(p);
+}
+
+/* The trace goes to $YAPIDH_TRACE, or TRACE_DEFAULT_PATH */
+struct platform *platform_init(uint32_t pins)
+{
+	const char *path = getenv("YAPIDH_TRACE");
+	struct platform *p = calloc(1, sizeof(*p));
+	if (!p) {
+		return NULL;
+	}
+
+	p->be = trace_backend_create(pins, path ? path : TRACE_DEFAULT_PATH);
+	if (!p->be) {
+		goto fail;
+	}
+
+	return p;
+
+fail:
+	platform_fini(p);
+	return NULL;
+}
+
+struct wave_backend *platform_get_backend(struct platform *p)
+{
+	return (struct wave_backend *)p->be;
+}
+
+int platform_sync(struct platform *p, int timeout_millis)
+{
+	// Roughly real time, for 1600 ticks of 10 us
+	usleep(16000);
+	return 0;
+}
+
+void platform_dump(struct platform *p)
+{
+	return;
+}
+
+void platform_get_stats(struct platform *p, struct platform_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
@@ -16,15 +16,32 @@
  */
 #ifndef __TYPES_H__
 #define __TYPES_H__
+#include <stdint.h>
 
 enum event_type {
 	EVENT_RISING_EDGE,
 	EVENT_FALLING_EDGE,
+	/* Nothing to do, the source just wants to be polled again later */
+	EVENT_NONE,
+	/* Rising edges on the pins in rising, and falling edges on falling */
+	EVENT_EDGES,
+	/* Flip the level of channel. Backends keep track of the pin levels */
+	EVENT_TOGGLE,
 };
 
 struct event {
 	enum event_type type;
 	int channel;
+
+	/* Pin masks, only used by EVENT_EDGES */
+	uint32_t rising;
+	uint32_t falling;
+};
+
+/* An event, and the delay until the source's next one */
+struct timed_event {
+	struct event ev;
+	int delay;
 };
 
 #endif /* __TYPES_H__ */
@@ -17,95 +17,234 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "platform.h"
 #include "vcd_backend.h"
 #include "types.h"
 
-static void vcd_backend_add_event(struct wave_backend *wb, struct source *s)
+static void vcd_backend_emit_event(struct wave_backend *wb, const struct event *ev)
 {
 	struct vcd_backend *be = (struct vcd_backend *)wb;
-	struct event ev;
+	uint32_t bit;
 
-	s->gen_event(s, &ev);
-
-	switch (ev.type) {
+	switch (ev->type) {
 	case EVENT_RISING_EDGE:
-		be->rising |= (1 << ev.channel);
+		be->rising |= (1 << ev->channel);
 		break;
 	case EVENT_FALLING_EDGE:
-		be->falling |= (1 << ev.channel);
+		be->falling |= (1 << ev->channel);
+		break;
+	case EVENT_EDGES:
+		be->rising |= ev->rising;
+		be->falling |= ev->falling;
+		break;
+	case EVENT_TOGGLE:
+		bit = 1 << ev->channel;
+		if (((be->level | be->rising) & ~be->falling) & bit) {
+			be->rising &= ~bit;
+			be->falling |= bit;
+		} else {
+			be->falling &= ~bit;
+			be->rising |= bit;
+		}
+		break;
+	case EVENT_NONE:
 		break;
 	}
 }
 
-static char get_id(struct vcd_backend *be, int pin)
+static void vcd_backend_add_event(struct wave_backend *wb, struct source *s)
 {
-	int i;
-	for (i = 0; i < be->n_channels; i++) {
-		if (pin == be->pins[i]) {
-			return '!' + i;
-		}
+	struct event ev;
+
+	s->gen_event(s, &ev);
+	vcd_backend_emit_event(wb, &ev);
+}
+
+/* IDs are base-94 numbers, using the printable characters '!' to '~' */
+static void vcd_make_id(struct vcd_id *id, int idx)
+{
+	id->len = 0;
+	do {
+		id->str[id->len++] = '!' + (idx % 94);
+		idx /= 94;
+	} while (idx && id->len < VCD_ID_MAX);
+}
+
+/* Slot header plus a value change for every pin */
+#define VCD_SLOT_MAX (22 + (32 * (VCD_ID_MAX + 2)) + 1)
+
+static char *vcd_put_u64(char *p, uint64_t val)
+{
+	char tmp[20];
+	int n = 0;
+
+	do {
+		tmp[n++] = '0' + (val % 10);
+		val /= 10;
+	} while (val);
+
+	while (n) {
+		*p++ = tmp[--n];
+	}
+
+	return p;
+}
+
+/*
+ * Changes go out in pin order, and a pin with both edges in one slot ends up
+ * low, the same as be->level. IDs are always copied whole, so this can write
+ * up to VCD_ID_MAX bytes past the end of what it returns.
+ */
+static char *vcd_put_changes(char *p, struct vcd_id *ids, uint32_t rising,
+			     uint32_t falling)
+{
+	uint32_t mask = rising | falling;
+
+	while (mask) {
+		int pin = __builtin_ctz(mask);
+		struct vcd_id *id = &ids[pin];
+
+		*p++ = ((rising & ~falling) & (1 << pin)) ? '1' : '0';
+		memcpy(p, id->str, VCD_ID_MAX);
+		p += id->len;
+		*p++ = ' ';
+
+		mask &= mask - 1;
 	}
 
-	fprintf(stderr, "Unknown pin %d\n", pin);
-	return '\0';
+	return p;
+}
+
+static void vcd_backend_write(struct vcd_backend *be)
+{
+	fwrite(be->buf, 1, be->len, be->fp);
+	be->bytes += be->len;
+	be->len = 0;
+}
+
+void vcd_backend_flush(struct vcd_backend *be)
+{
+	vcd_backend_write(be);
+	fflush(be->fp);
 }
 
 static void vcd_backend_add_delay(struct wave_backend *wb, int delay)
 {
 	struct vcd_backend *be = (struct vcd_backend *)wb;
-	int i;
+	uint32_t rising = be->rising & be->pins;
+	uint32_t falling = be->falling & be->pins;
+	char *p;
 
-	printf("#%d ", be->time);
-	for (i = 0; i < 32; i++) {
-		if (be->rising & (1 << i)) {
-			printf("1%c ", get_id(be, i));
-		}
-		if (be->falling & (1 << i)) {
-			printf("0%c ", get_id(be, i));
+	/* Slots with no changes don't need to be in the output at all */
+	if (rising | falling) {
+		if (be->len > VCD_BUF_SIZE - VCD_SLOT_MAX) {
+			vcd_backend_write(be);
 		}
+
+		p = be->buf + be->len;
+		*p++ = '#';
+		p = vcd_put_u64(p, be->time);
+		*p++ = ' ';
+		p = vcd_put_changes(p, be->ids, rising, falling);
+		*p++ = '\n';
+		be->len = p - be->buf;
 	}
-	printf("\n");
 
+	be->level = (be->level | be->rising) & ~be->falling;
 	be->rising = be->falling = 0;
 	be->time += delay;
 }
 
+static void vcd_backend_end_wave(struct wave_backend *wb)
+{
+	vcd_backend_flush((struct vcd_backend *)wb);
+}
+
+/* Expand a run straight into the output, without going back to wave_gen per edge */
+static int vcd_backend_add_run(struct wave_backend *wb, struct step_run *run, int limit)
+{
+	struct vcd_backend *be = (struct vcd_backend *)wb;
+	uint32_t mask = 1 << run->channel;
+	struct event ev = { .type = EVENT_TOGGLE, .channel = run->channel };
+	int ticks = 0;
+
+	while (run->count) {
+		int interval = step_run_interval(run);
+		int delay = step_run_clip(run, ticks, limit);
+
+		if (!delay) {
+			break;
+		}
+
+		if (!run->pulsewidth) {
+			vcd_backend_emit_event(wb, &ev);
+			vcd_backend_add_delay(wb, delay);
+		} else {
+			be->rising = mask;
+			vcd_backend_add_delay(wb, run->pulsewidth);
+			be->falling = mask;
+			vcd_backend_add_delay(wb, delay - run->pulsewidth);
+		}
+
+		ticks += interval;
+		step_run_advance(run);
+	}
+
+	return ticks;
+}
+
 void vcd_backend_fini(struct vcd_backend *be)
 {
+	if (be->buf) {
+		vcd_backend_flush(be);
+	}
+	free(be->buf);
 	free(be);
 }
 
-struct vcd_backend *vcd_backend_create(uint32_t pins)
+struct vcd_backend *vcd_backend_create(uint32_t pins, FILE *fp)
 {
 	struct vcd_backend *be = calloc(1, sizeof(*be));
-	int i, n;
+	int i;
 
-	be->base.add_delay = vcd_backend_add_delay;
-	be->base.add_event = vcd_backend_add_event;
+	if (!be) {
+		return NULL;
+	}
 
-	for (i = 0; i < 32; i++) {
-		if (pins & (1 << i)) {
-			be->n_channels++;
-		}
+	be->buf = malloc(VCD_BUF_SIZE);
+	if (!be->buf) {
+		goto fail;
 	}
-	be->pins = calloc(be->n_channels, sizeof(*be->pins));
 
-	printf("$timescale 10 us $end\n");
+	be->fp = fp;
+	be->pins = pins;
+	be->base.add_delay = vcd_backend_add_delay;
+	be->base.add_event = vcd_backend_add_event;
+	be->base.emit_event = vcd_backend_emit_event;
+	be->base.add_run = vcd_backend_add_run;
+	be->base.end_wave = vcd_backend_end_wave;
+
+	fprintf(fp, "$timescale 10 us $end\n");
 
-	n = 0;
 	for (i = 0; i < 32; i++) {
 		if (pins & (1 << i)) {
-			be->pins[n] = i;
-			printf("$var wire 1 %c pin%d $end\n", '!' + n, i);
-			n++;
+			struct vcd_id *id = &be->ids[i];
+
+			vcd_make_id(id, be->n_channels++);
+			fprintf(fp, "$var wire 1 %.*s pin%d $end\n", id->len, id->str, i);
 		}
 	}
 
-	printf("$enddefinitions $end\n");
+	fprintf(fp, "$enddefinitions $end\n");
 
 	return be;
+
+fail:
+	vcd_backend_fini(be);
+	return NULL;
 }
 
 struct platform {
@@ -127,7 +266,7 @@ struct platform *platform_init(uint32_t pins)
 		return NULL;
 	}
 
-	p->be = vcd_backend_create(pins);
+	p->be = vcd_backend_create(pins, stdout);
 	if (!p->be) {
 		goto fail;
 	}
@@ -155,3 +294,8 @@ void platform_dump(struct platform *p)
 {
 	return;
 }
+
+void platform_get_stats(struct platform *p, struct platform_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
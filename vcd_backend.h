@@ -17,21 +17,44 @@
 #ifndef __VCD_BACKEND_H__
 #define __VCD_BACKEND_H__
 #include <stdint.h>
+#include <stdio.h>
 
 #include "wave_gen.h"
 
+/* Enough for 94^4 channels */
+#define VCD_ID_MAX 4
+#define VCD_BUF_SIZE (1024 * 1024)
+
+struct vcd_id {
+	uint8_t len;
+	char str[VCD_ID_MAX];
+};
+
 struct vcd_backend {
 	struct wave_backend base;
 
+	FILE *fp;
 	int n_channels;
-	int *pins;
+	/* Pins in the output. Edges on any others are dropped */
+	uint32_t pins;
+	/* Indexed by pin */
+	struct vcd_id ids[32];
+
+	/* Output waiting to be written to fp */
+	char *buf;
+	int len;
+	/* Total written to fp, not counting the header */
+	uint64_t bytes;
 
-	int time;
+	uint64_t time;
 	uint32_t rising;
 	uint32_t falling;
+	/* Pin levels at the end of the last slot, for EVENT_TOGGLE */
+	uint32_t level;
 };
 
-struct vcd_backend *vcd_backend_create(uint32_t pins);
+struct vcd_backend *vcd_backend_create(uint32_t pins, FILE *fp);
+void vcd_backend_flush(struct vcd_backend *be);
 void vcd_backend_fini(struct vcd_backend *be);
 
 #endif /* __VCD_BACKEND_H__ */
@@ -18,40 +18,370 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
+#include <stdlib.h>
+
 #include "wave_gen.h"
+#include "types.h"
+
+/* The deadline of a source which is idle, waiting to be woken */
+#define DEADLINE_IDLE UINT64_MAX
+
+static void sched_sift_up(struct sched_entry *sched, int i)
+{
+	struct sched_entry e = sched[i];
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (sched[parent].deadline <= e.deadline) {
+			break;
+		}
+		sched[i] = sched[parent];
+		i = parent;
+	}
+	sched[i] = e;
+}
+
+static void sched_sift_down(struct sched_entry *sched, int n, int i)
+{
+	struct sched_entry e = sched[i];
+
+	while (1) {
+		int child = (2 * i) + 1;
+		if (child >= n) {
+			break;
+		}
+		if ((child + 1 < n) && (sched[child + 1].deadline < sched[child].deadline)) {
+			child++;
+		}
+		if (sched[child].deadline >= e.deadline) {
+			break;
+		}
+		sched[i] = sched[child];
+		i = child;
+	}
+	sched[i] = e;
+}
+
+static struct wave_batch *wave_batch_create(void)
+{
+	struct wave_batch *b = calloc(1, sizeof(*b));
+	if (!b) {
+		return NULL;
+	}
+
+	b->buf = calloc(WAVE_BATCH_LEN, sizeof(*b->buf));
+	if (!b->buf) {
+		free(b);
+		return NULL;
+	}
+
+	return b;
+}
+
+static void wave_batch_destroy(struct wave_batch *b)
+{
+	if (!b) {
+		return;
+	}
+	free(b->buf);
+	free(b);
+}
+
+int wave_ctx_add_source(struct wave_ctx *c, struct source *s)
+{
+	struct wave_batch *batch = NULL;
+	struct wave_run *run = NULL;
+
+	if ((s->fill || s->get_run) && !c->be->emit_event) {
+		return -1;
+	}
 
-#define MAX_SOURCES 4
+	if (s->fill) {
+		batch = wave_batch_create();
+		if (!batch) {
+			return -1;
+		}
+	}
+
+	if (s->get_run) {
+		run = calloc(1, sizeof(*run));
+		if (!run) {
+			wave_batch_destroy(batch);
+			return -1;
+		}
+	}
+
+	if (c->n_sources == c->max_sources) {
+		int max = c->max_sources ? c->max_sources * 2 : 4;
+		struct sched_entry *sched = realloc(c->sched, max * sizeof(*sched));
+		if (!sched) {
+			wave_batch_destroy(batch);
+			free(run);
+			return -1;
+		}
+		c->sched = sched;
+		c->max_sources = max;
+	}
+
+	/* New sources generate their first event straight away */
+	s->ctx = c;
+	c->sched[c->n_sources].deadline = c->now;
+	c->sched[c->n_sources].source = s;
+	c->sched[c->n_sources].batch = batch;
+	c->sched[c->n_sources].run = run;
+	sched_sift_up(c->sched, c->n_sources);
+	c->n_sources++;
+
+	return 0;
+}
+
+static int wave_ctx_find_source(struct wave_ctx *c, struct source *s)
+{
+	int i;
+
+	for (i = 0; i < c->n_sources; i++) {
+		if (c->sched[i].source == s) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void wave_ctx_wake_source(struct wave_ctx *c, struct source *s)
+{
+	int i = wave_ctx_find_source(c, s);
+
+	if (i >= 0 && c->sched[i].deadline == DEADLINE_IDLE) {
+		c->sched[i].deadline = c->now;
+		sched_sift_up(c->sched, i);
+	}
+}
+
+uint32_t wave_ctx_cancel_run(struct wave_ctx *c, struct source *s, struct step_run *rest)
+{
+	int i = wave_ctx_find_source(c, s);
+	struct wave_run *r;
+
+	if (i < 0 || !c->sched[i].run || !c->sched[i].run->run.count) {
+		return 0;
+	}
+
+	r = c->sched[i].run;
+	*rest = r->run;
+	if (r->high) {
+		/* Let the falling edge and the rest of the interval go out */
+		step_run_advance(rest);
+		r->run.count = 1;
+	} else {
+		r->run.count = 0;
+	}
+
+	return rest->count;
+}
+
+uint32_t wave_ctx_run_pending(struct wave_ctx *c, struct source *s)
+{
+	int i = wave_ctx_find_source(c, s);
+
+	if (i < 0 || !c->sched[i].run) {
+		return 0;
+	}
+
+	return c->sched[i].run->run.count - c->sched[i].run->high;
+}
+
+void wave_ctx_fini(struct wave_ctx *c)
+{
+	int i;
+
+	for (i = 0; i < c->n_sources; i++) {
+		wave_batch_destroy(c->sched[i].batch);
+		free(c->sched[i].run);
+	}
+	free(c->sched);
+	c->sched = NULL;
+	c->n_sources = c->max_sources = 0;
+}
+
+/* Send a batched source's next event, refilling the batch if it's empty */
+static int wave_gen_batch_event(struct wave_ctx *c, struct source *s,
+				struct wave_batch *b, int horizon)
+{
+	struct timed_event *te;
+
+	if (b->idx == b->n) {
+		b->n = s->fill(s, b->buf, WAVE_BATCH_LEN, horizon);
+		b->idx = 0;
+	}
+
+	te = &b->buf[b->idx++];
+	c->be->emit_event(c->be, &te->ev);
+
+	return te->delay;
+}
+
+/*
+ * Returns true if the source is in the middle of a run, asking it for a
+ * new one if it's finished the last one
+ */
+static int wave_gen_in_run(struct sched_entry *e)
+{
+	struct wave_run *r = e->run;
+
+	if (!r) {
+		return 0;
+	}
+
+	if (r->run.count) {
+		return 1;
+	}
+
+	/* Batched events come first */
+	if (e->batch && e->batch->idx != e->batch->n) {
+		return 0;
+	}
+
+	r->high = 0;
+	if (!e->source->get_run(e->source, &r->run)) {
+		r->run.count = 0;
+	}
+
+	return r->run.count != 0;
+}
+
+/* Send the next edge of a run, one event at a time */
+static int wave_gen_run_event(struct wave_ctx *c, struct wave_run *r)
+{
+	struct event ev = { .channel = r->run.channel };
+	int delay;
+
+	if (!r->run.pulsewidth) {
+		ev.type = EVENT_TOGGLE;
+		delay = step_run_interval(&r->run);
+		step_run_advance(&r->run);
+		c->run_steps_split++;
+	} else if (!r->high) {
+		ev.type = EVENT_RISING_EDGE;
+		delay = r->run.pulsewidth;
+	} else {
+		ev.type = EVENT_FALLING_EDGE;
+		delay = step_run_interval(&r->run) - r->run.pulsewidth;
+		step_run_advance(&r->run);
+		c->run_steps_split++;
+	}
+	if (r->run.pulsewidth) {
+		r->high = !r->high;
+	}
+
+	c->be->emit_event(c->be, &ev);
+
+	return delay;
+}
+
+/*
+ * If the source at the top of the heap is at the start of a step in a run,
+ * hand as much of the run as possible to the backend in one go, up to when
+ * the next source is due. The source picks up the rest of the run from
+ * wherever the backend got to. Returns true if anything was sent.
+ */
+static int wave_gen_run_fast(struct wave_ctx *c, uint64_t end)
+{
+	struct sched_entry *e = &c->sched[0];
+	uint64_t limit = end;
+	uint32_t count;
+	int i, ticks;
+
+	if (!c->be->add_run || e->deadline != c->now || !e->run ||
+	    !e->run->run.count || e->run->high) {
+		return 0;
+	}
+
+	for (i = 1; i <= 2 && i < c->n_sources; i++) {
+		if (c->sched[i].deadline < limit) {
+			limit = c->sched[i].deadline;
+		}
+	}
+
+	/* Not even the pulse fits, see step_run_clip() */
+	if (limit - c->now <= (uint64_t)e->run->run.pulsewidth) {
+		return 0;
+	}
+
+	count = e->run->run.count;
+	ticks = c->be->add_run(c->be, &e->run->run, limit - c->now);
+	if (!ticks) {
+		return 0;
+	}
+	c->run_steps += count - e->run->run.count;
+
+	/* The backend waited until limit at most */
+	e->deadline = c->now + ticks;
+	sched_sift_down(c->sched, c->n_sources, 0);
+	c->now = e->deadline < limit ? e->deadline : limit;
+
+	return 1;
+}
 
 void wave_gen(struct wave_ctx *c, int budget)
 {
-	int i, min;
+	uint64_t end = c->now + budget;
+	uint64_t next;
+	int n_due;
 
 	if (c->be->start_wave) {
 		c->be->start_wave(c->be);
 	}
 
-	while (budget) {
-		min = budget;
+	while (c->now < end) {
+		if (c->be->full && c->be->full(c->be)) {
+			break;
+		}
 
-		for (i = 0; i < c->n_sources; i++) {
-			// TODO: Should combine events where possible
-			if (c->t[i] == 0) {
-				struct source *s = c->sources[i];
+		if (c->n_sources && wave_gen_run_fast(c, end)) {
+			continue;
+		}
+
+		/*
+		 * Every source which is due on this tick goes into the same
+		 * slot. Each source gets at most one event per slot, so the
+		 * delay is clamped to one tick, and a zero-length delay is
+		 * never emitted.
+		 */
+		n_due = 0;
+		while (c->n_sources && c->sched[0].deadline == c->now) {
+			struct source *s = c->sched[0].source;
+			int delay;
+
+			if (wave_gen_in_run(&c->sched[0])) {
+				delay = wave_gen_run_event(c, c->sched[0].run);
+			} else if (c->sched[0].batch) {
+				delay = wave_gen_batch_event(c, s, c->sched[0].batch,
+							     end - c->now);
+			} else {
 				c->be->add_event(c->be, s);
-				c->t[i] = s->get_delay(s);
+				delay = s->get_delay(s);
 			}
-			if (c->t[i] < min) {
-				min = c->t[i];
+			if (delay == SOURCE_DELAY_IDLE) {
+				c->sched[0].deadline = DEADLINE_IDLE;
+			} else {
+				c->sched[0].deadline = c->now + (delay < 1 ? 1 : delay);
 			}
+			sched_sift_down(c->sched, c->n_sources, 0);
+			n_due++;
 		}
 
-		c->be->add_delay(c->be, min);
+		if (n_due > 1) {
+			c->slots_saved += n_due - 1;
+		}
 
-		for (i = 0; i < c->n_sources; i++) {
-			c->t[i] -= min;
+		next = end;
+		if (c->n_sources && c->sched[0].deadline < next) {
+			next = c->sched[0].deadline;
 		}
 
-		budget -= min;
+		c->be->add_delay(c->be, next - c->now);
+		c->now = next;
 	}
 
 	if (c->be->end_wave) {
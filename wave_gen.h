@@ -20,32 +20,188 @@
  */
 #ifndef __WAVE_GEN_H__
 #define __WAVE_GEN_H__
-
-#define MAX_SOURCES 4
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 /* event is defined by the backend */
 struct event;
+struct timed_event;
+struct wave_ctx;
+
+/*
+ * A delay which sources can return when they have nothing more to do. The
+ * source isn't asked for anything else until wave_ctx_wake_source()
+ */
+#define SOURCE_DELAY_IDLE INT_MAX
+
+/*
+ * A run of count step pulses on channel, in the style of Klipper's
+ * queue_step. The first rising edge is due now, and each pulse is
+ * followed by an interval (measured rising edge to rising edge) which
+ * starts at interval and changes by add after every step. The source is
+ * due again one interval after the last step.
+ *
+ * frac is the fractional part of the interval (Q0.32), for error diffusion:
+ * it's added to residual after every step, and each time that carries, the
+ * step's interval is one tick longer. Use step_run_interval() and
+ * step_run_advance() rather than interval directly.
+ *
+ * A pulsewidth of 0 means each step is a single EVENT_TOGGLE, for drivers
+ * which step on both edges.
+ */
+struct step_run {
+	int channel;
+	int pulsewidth;
+	uint32_t count;
+	int32_t interval;
+	int32_t add;
+	uint32_t frac;
+	uint32_t residual;
+};
+
+/* The interval after the run's next step */
+static inline int32_t step_run_interval(const struct step_run *run)
+{
+	return run->interval + ((uint32_t)(run->residual + run->frac) < run->residual);
+}
+
+/* Move on past the run's next step */
+static inline void step_run_advance(struct step_run *run)
+{
+	run->residual += run->frac;
+	run->interval += run->add;
+	run->count--;
+}
+
+/*
+ * For add_run(): how long to wait after the run's next step, which starts
+ * ticks into the run, without going past limit. Returns 0 if the step
+ * doesn't fit, which is when either of its edges would be at or past limit.
+ */
+static inline int step_run_clip(const struct step_run *run, int ticks, int limit)
+{
+	int interval = step_run_interval(run);
+
+	if (interval <= run->pulsewidth || ticks + run->pulsewidth >= limit) {
+		return 0;
+	}
+
+	return ticks + interval > limit ? limit - ticks : interval;
+}
 
 struct source {
 	int (*get_delay)(struct source *);
 	void (*gen_event)(struct source *, struct event *ev);
+
+	/*
+	 * Optional. Generate up to max events in one go, each with the
+	 * delay to the one after it, the same as gen_event() followed by
+	 * get_delay(). The first event is due now. Sources should stop
+	 * once the delays add up to horizon ticks, but must always
+	 * generate at least one event.
+	 */
+	int (*fill)(struct source *, struct timed_event *buf, int max, int horizon);
+
+	/*
+	 * Optional. If the source's next events can be described as a
+	 * step_run, fill in run, update the source's state to just after
+	 * it, and return 1. Otherwise return 0.
+	 */
+	int (*get_run)(struct source *, struct step_run *run);
+
+	/* Set by wave_ctx_add_source() */
+	struct wave_ctx *ctx;
 };
 
 struct wave_backend {
 	void (*start_wave)(struct wave_backend *wb);
 	void (*add_delay)(struct wave_backend *wb, int delay);
 	void (*add_event)(struct wave_backend *wb, struct source *s);
+	/* Needed for sources with fill(), which hand over events directly */
+	void (*emit_event)(struct wave_backend *wb, const struct event *ev);
+	/*
+	 * Optional. Consume steps from the front of run while their edges
+	 * come before limit ticks, updating run to match. The wait after the
+	 * last step is cut short at limit, see step_run_clip(). Returns the
+	 * number of ticks from the first step to the one after the last step
+	 * consumed, which can be past limit. Nothing else happens until then,
+	 * or until limit if that's sooner.
+	 */
+	int (*add_run)(struct wave_backend *wb, struct step_run *run, int limit);
+	/*
+	 * Optional. True if the backend might not have room for another slot.
+	 * wave_gen() then ends the wave early, and the rest of the budget
+	 * carries over into the next wave.
+	 */
+	bool (*full)(struct wave_backend *wb);
 	void (*end_wave)(struct wave_backend *wb);
 };
 
+#define WAVE_BATCH_LEN 64
+
+/* Events from a source's fill() which haven't been sent to the backend yet */
+struct wave_batch {
+	int n;
+	int idx;
+	struct timed_event *buf;
+};
+
+/* The rest of a source's current step_run */
+struct wave_run {
+	struct step_run run;
+	/* The rising edge has been sent, the falling edge is next */
+	int high;
+};
+
+struct sched_entry {
+	uint64_t deadline;
+	struct source *source;
+	/* Only for sources with fill() */
+	struct wave_batch *batch;
+	/* Only for sources with get_run() */
+	struct wave_run *run;
+};
+
 struct wave_ctx {
-	int n_sources;
 	struct wave_backend *be;
-	struct source *sources[MAX_SOURCES];
 
-	int t[MAX_SOURCES];
+	/* Min-heap of sources, ordered by the absolute tick of their next event */
+	int n_sources;
+	int max_sources;
+	struct sched_entry *sched;
+
+	uint64_t now;
+
+	/* Number of events which shared a slot with another event */
+	uint64_t slots_saved;
+	/* Steps handed to the backend as part of a run */
+	uint64_t run_steps;
+	/* Steps from runs which wave_gen had to send as single events */
+	uint64_t run_steps_split;
 };
 
+int wave_ctx_add_source(struct wave_ctx *c, struct source *s);
+void wave_ctx_fini(struct wave_ctx *c);
+/*
+ * Make a source which returned SOURCE_DELAY_IDLE due again straight away.
+ * Does nothing if the source isn't idle. Not for use inside wave_gen()
+ */
+void wave_ctx_wake_source(struct wave_ctx *c, struct source *s);
+/*
+ * Take back the steps of s's current run which haven't been started, so
+ * the source can change course. A step which is part-way through is left to
+ * finish. Fills in rest from the first step taken back, and returns the
+ * number of steps taken back. Not for use inside wave_gen()
+ */
+uint32_t wave_ctx_cancel_run(struct wave_ctx *c, struct source *s, struct step_run *rest);
+/* The number of steps in s's current run which haven't been started */
+uint32_t wave_ctx_run_pending(struct wave_ctx *c, struct source *s);
+
+/*
+ * Generate budget ticks as one wave, or fewer if the backend fills up. The
+ * next wave picks up where this one stopped.
+ */
 void wave_gen(struct wave_ctx *c, int budget);
 
 #endif /* __WAVE_GEN_H__ */